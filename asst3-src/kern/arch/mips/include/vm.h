@@ -126,14 +126,22 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+#define TLBSHOOTDOWN_MAX 16
+
+struct addrspace;
+
+/*
+ * One shootdown request: invalidate ts_npages pages of address space
+ * ts_as, or all of it if ts_all is set (which is what more than
+ * TLBSHOOTDOWN_MAX pages turn into). A CPU that isn't running ts_as
+ * has no translations for it and ignores the request.
+ */
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;
+	bool ts_all;
+	unsigned ts_npages;
+	vaddr_t ts_vaddrs[TLBSHOOTDOWN_MAX];
 };
 
-#define TLBSHOOTDOWN_MAX 16
-
 
 #endif /* _MIPS_VM_H_ */
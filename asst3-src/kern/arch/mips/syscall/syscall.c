@@ -37,6 +37,7 @@
 #include <current.h>
 #include <copyinout.h>
 #include <syscall.h>
+#include "opt-dumbvm.h"
 
 
 /*
@@ -113,6 +114,11 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+
 
 	    /* process calls */
 
@@ -261,6 +267,33 @@ syscall(struct trapframe *tf)
 		}
 		break;
 
+#if !OPT_DUMBVM
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+	    case SYS_mmap:
+		{
+			/*
+			 * The offset is 64 bits wide and would be in
+			 * an aligned register pair; a2 is taken by fd,
+			 * so it's on the stack (a3 goes unused).
+			 */
+			off_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(offset));
+			if (err) {
+				break;
+			}
+			err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				       offset, &retval);
+		}
+		break;
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0);
+		break;
+#endif
+
 
 
 	    default:
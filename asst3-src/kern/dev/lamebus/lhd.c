@@ -36,7 +36,9 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <current.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -60,6 +62,9 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Sectors lhd_io moves through its buffer at a time, for user memory */
+#define LHD_BOUNCESECT  8
+
 /*
  * Shortcut for reading a register.
  */
@@ -96,41 +101,191 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Copy the current sector of LR between SECT and LR's memory, in the
+ * direction RW, and move LR's place in its memory on.
+ */
+static
+void
+lhd_copy(struct lhd_request *lr, char *sect, enum uio_rw rw)
+{
+	const struct iovec *iov;
+	char *ptr;
+	size_t n, done = 0;
+
+	while (done < LHD_SECTSIZE) {
+		KASSERT(lr->lr_iovix < lr->lr_iovcnt);
+		iov = &lr->lr_iov[lr->lr_iovix];
+		ptr = (char *)iov->iov_kbase + lr->lr_iovoff;
+		n = iov->iov_len - lr->lr_iovoff;
+		if (n > LHD_SECTSIZE - done) {
+			n = LHD_SECTSIZE - done;
+		}
+		if (rw == UIO_WRITE) {
+			memcpy(sect + done, ptr, n);
+		}
+		else {
+			memcpy(ptr, sect + done, n);
+		}
+		done += n;
+		lr->lr_iovoff += n;
+		if (lr->lr_iovoff == iov->iov_len) {
+			lr->lr_iovix++;
+			lr->lr_iovoff = 0;
+		}
+	}
+}
+
+/*
+ * Start the disk on the next sector of the current request. Call
+ * with lh_lock held.
+ */
+static
+void
+lhd_go(struct lhd_softc *lh)
+{
+	struct lhd_request *lr = lh->lh_cur;
+	uint32_t statval = LHD_WORKING;
+
+	/* If writing, transfer the data to the on-card buffer. */
+	if (lr->lr_rw == UIO_WRITE) {
+		lhd_copy(lr, lh->lh_buf, UIO_WRITE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, lr->lr_sector + lr->lr_sectdone);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is free, take the next request (or merged run of them)
+ * the scheduler picks and start it. Call with lh_lock held.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_start(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct iosched_node *in;
+
+	if (lh->lh_cur != NULL) {
+		return;
+	}
+	in = iosched_next(&lh->lh_sched);
+	if (in == NULL) {
+		return;
+	}
+	lh->lh_cur = in->in_self;
+	lhd_go(lh);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, and go straight on to the next sector of the request, or
+ * to the next request, so the disk never waits for a thread to be
+ * scheduled. Then report completion if a request has finished.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct lhd_request *lr;
 	uint32_t val;
+	int result;
+
+	spinlock_acquire(&lh->lh_lock);
 
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
-	    case LHD_IDLE:
-	    case LHD_WORKING:
-		break;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
+	    default:
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	lr = lh->lh_cur;
+	if (lr == NULL) {
+		/* Nothing was going on; ignore it. */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	result = lhd_code_to_errno(lh, val);
+	if (result == 0) {
+		/* If reading, transfer the data out of the on-card buffer. */
+		if (lr->lr_rw == UIO_READ) {
+			membar_load_load();
+			lhd_copy(lr, lh->lh_buf, UIO_READ);
+		}
+		lr->lr_sectdone++;
+		if (lr->lr_sectdone < lr->lr_nsect) {
+			lhd_go(lh);
+			spinlock_release(&lh->lh_lock);
+			return;
+		}
+	}
+
+	/*
+	 * This request is over; get the next one going first. If it
+	 * was merged with the ones after it, they carry straight on
+	 * from where it ended.
+	 */
+	if (lr->lr_node.in_merged != NULL) {
+		lh->lh_cur = lr->lr_node.in_merged->in_self;
+		lhd_go(lh);
+	}
+	else {
+		lh->lh_cur = NULL;
+		lhd_start(lh);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	lr->lr_done(lr, result);
+}
+
+int
+lhd_submit(struct lhd_softc *lh, struct lhd_request *lr)
+{
+	size_t len;
+	unsigned i;
+
+	/* Don't allow empty requests, or I/O past the end of the disk. */
+	if (lr->lr_nsect == 0 || lr->lr_sector >= lh->lh_dev.d_blocks ||
+	    lr->lr_nsect > lh->lh_dev.d_blocks - lr->lr_sector) {
+		return EINVAL;
 	}
+
+	/* There must be memory for all of it. */
+	len = 0;
+	for (i=0; i<lr->lr_iovcnt; i++) {
+		len += lr->lr_iov[i].iov_len;
+	}
+	if (len < (size_t)lr->lr_nsect * LHD_SECTSIZE) {
+		return EINVAL;
+	}
+
+	lr->lr_sectdone = 0;
+	lr->lr_iovix = 0;
+	lr->lr_iovoff = 0;
+	lr->lr_node.in_sector = lr->lr_sector;
+	lr->lr_node.in_nsect = lr->lr_nsect;
+	lr->lr_node.in_write = (lr->lr_rw == UIO_WRITE);
+	lr->lr_node.in_self = lr;
+
+	spinlock_acquire(&lh->lh_lock);
+	iosched_add(&lh->lh_sched, &lr->lr_node);
+	lhd_start(lh);
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
 }
 
 /*
@@ -180,7 +335,110 @@ lhd_reset(struct lhd_softc *lh)
 #endif
 
 /*
- * I/O function (for both reads and writes)
+ * For lhd_io: a request that a thread is waiting for. Only that
+ * thread is woken when it finishes, not everyone waiting on the disk;
+ * lw_sleeping says whether it's on lh_wchan yet.
+ */
+struct lhd_waiter {
+	struct lhd_softc *lw_lh;
+	struct thread *lw_thread;
+	bool lw_sleeping;
+	bool lw_done;
+	int lw_result;
+};
+
+/*
+ * Completion function for lhd_io's requests.
+ */
+static
+void
+lhd_wakewaiter(struct lhd_request *lr, int result)
+{
+	struct lhd_waiter *lw = lr->lr_data;
+	struct lhd_softc *lh = lw->lw_lh;
+
+	spinlock_acquire(&lh->lh_lock);
+	lw->lw_result = result;
+	lw->lw_done = true;
+	if (lw->lw_sleeping) {
+		wchan_wakethread(lh->lh_wchan, lw->lw_thread, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Do a request and wait for it to finish.
+ */
+static
+int
+lhd_dowait(struct lhd_softc *lh, uint32_t sector, uint32_t nsect,
+	   enum uio_rw rw, const struct iovec *iov, unsigned iovcnt)
+{
+	struct lhd_request lr;
+	struct lhd_waiter lw;
+	int result;
+
+	lw.lw_lh = lh;
+	lw.lw_thread = curthread;
+	lw.lw_sleeping = false;
+	lw.lw_done = false;
+	lw.lw_result = 0;
+
+	lr.lr_sector = sector;
+	lr.lr_nsect = nsect;
+	lr.lr_rw = rw;
+	lr.lr_iov = iov;
+	lr.lr_iovcnt = iovcnt;
+	lr.lr_done = lhd_wakewaiter;
+	lr.lr_data = &lw;
+
+	result = lhd_submit(lh, &lr);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!lw.lw_done) {
+		lw.lw_sleeping = true;
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+		lw.lw_sleeping = false;
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return lw.lw_result;
+}
+
+/*
+ * Account for LEN bytes having been moved into or out of UIO's
+ * (kernel) memory behind uiomove's back.
+ */
+static
+void
+lhd_uioskip(struct uio *uio, size_t len)
+{
+	struct iovec *iov;
+	size_t n;
+
+	while (len > 0) {
+		KASSERT(uio->uio_iovcnt > 0);
+		iov = uio->uio_iov;
+		n = iov->iov_len < len ? iov->iov_len : len;
+		iov->iov_kbase = (char *)iov->iov_kbase + n;
+		iov->iov_len -= n;
+		uio->uio_offset += n;
+		uio->uio_resid -= n;
+		len -= n;
+		if (iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+		}
+	}
+}
+
+/*
+ * I/O function (for both reads and writes). Kernel memory goes to
+ * the driver as it is, in one request; user memory is copied through
+ * a kernel buffer LHD_BOUNCESECT sectors at a time.
  */
 static
 int
@@ -192,8 +450,9 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	uint32_t i, n;
+	struct iovec iov;
+	char *bounce;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -201,67 +460,49 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
-		return EINVAL;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		result = lhd_dowait(lh, sector, len, uio->uio_rw,
+				    uio->uio_iov, uio->uio_iovcnt);
+		if (result) {
+			return result;
+		}
+		lhd_uioskip(uio, len * LHD_SECTSIZE);
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	bounce = kmalloc(LHD_BOUNCESECT * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	result = 0;
+	for (i=0; i<len; i += n) {
+		n = len - i < LHD_BOUNCESECT ? len - i : LHD_BOUNCESECT;
+		iov.iov_kbase = bounce;
+		iov.iov_len = n * LHD_SECTSIZE;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		result = lhd_dowait(lh, sector + i, n, uio->uio_rw, &iov, 1);
 		if (result) {
-			return result;
+			break;
+		}
+		if (uio->uio_rw == UIO_READ) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
 	}
-
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -284,17 +525,14 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_cur = NULL;
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
+	iosched_init(&lh->lh_sched, name, &lh->lh_lock);
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -31,12 +31,49 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <iosched.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * An I/O request. The caller fills in the first part and hands it to
+ * lhd_submit, which queues it and returns at once. Queued requests
+ * go to the disk in the order the I/O scheduler (iosched.h) picks,
+ * and adjacent ones together. When the request is finished (or fails) LR_DONE is called, from the disk's interrupt
+ * handler, with the result. The request and the memory it points to
+ * must stay put until then.
+ *
+ * The data moves between the disk and LR_IOV, which lists kernel
+ * memory to be gathered from or scattered to in order; it must add
+ * up to LR_NSECT sectors, though the pieces needn't be whole
+ * sectors. Because the copying is done in the interrupt handler it
+ * can't be user memory.
+ *
+ * LR_DONE runs in interrupt context: it mustn't sleep, but may V
+ * semaphores, wake wait channels, and submit more requests.
+ */
+struct lhd_request {
+	/* Filled in by the caller */
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsect;		/* Number of sectors */
+	enum uio_rw lr_rw;		/* UIO_READ or UIO_WRITE */
+	const struct iovec *lr_iov;	/* Memory to use */
+	unsigned lr_iovcnt;
+	void (*lr_done)(struct lhd_request *, int result);
+	void *lr_data;			/* For LR_DONE's use */
+
+	/* Private to the driver */
+	struct iosched_node lr_node;	/* Place in the queue */
+	uint32_t lr_sectdone;		/* Sectors transferred */
+	unsigned lr_iovix;		/* Current position in LR_IOV */
+	size_t lr_iovoff;
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +88,10 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the queue */
+	struct lhd_request *lh_cur;	/* Request the disk is working on */
+	struct iosched lh_sched;	/* Requests waiting */
+	struct wchan *lh_wchan;		/* lhd_io waits here */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +99,7 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/* Queue a request. Fails (with EINVAL) only if it's malformed. */
+int lhd_submit(struct lhd_softc *lh, struct lhd_request *lr);
+
 #endif /* _LAMEBUS_LHD_H_ */
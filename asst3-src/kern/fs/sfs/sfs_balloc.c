@@ -35,6 +35,7 @@
 #include <types.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -51,6 +52,26 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
 }
 
+/*
+ * Copy the block of the freemap with DISKBLOCK's bit in it to the
+ * buffer cache, which writes it back in due course. If that fails,
+ * leave the whole freemap to be written at the next sync.
+ */
+static
+void
+sfs_freemap_update(struct sfs_fs *sfs, daddr_t diskblock)
+{
+	uint32_t j = diskblock / SFS_BITSPERBLOCK;
+	char *freemapdata = bitmap_getdata(sfs->sfs_freemap);
+	int result;
+
+	result = sfs_writeblock(sfs, SFS_FREEMAP_START + j,
+				freemapdata + j*SFS_BLOCKSIZE, SFS_BLOCKSIZE);
+	if (result) {
+		sfs->sfs_freemapdirty = true;
+	}
+}
+
 /*
  * Allocate a block.
  */
@@ -63,7 +84,6 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 	if (result) {
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
@@ -74,8 +94,10 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
 		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		return result;
 	}
-	return result;
+	sfs_freemap_update(sfs, *diskblock);
+	return 0;
 }
 
 /*
@@ -85,7 +107,10 @@ void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs_freemap_update(sfs, diskblock);
+
+	/* Whatever was in it is of no more use. */
+	buffer_invalidate(&sfs->sfs_absfs, diskblock);
 }
 
 /*
@@ -36,6 +36,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -301,3 +302,72 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	return 0;
 }
 
+
+/*
+ * Write back one of a file's blocks, and the freemap block that
+ * records it as allocated.
+ */
+static
+int
+sfs_iflush_block(struct sfs_fs *sfs, daddr_t block)
+{
+	int result;
+
+	result = buffer_flush(&sfs->sfs_absfs, block);
+	if (result) {
+		return result;
+	}
+	return buffer_flush(&sfs->sfs_absfs,
+			    SFS_FREEMAP_START + block / SFS_BITSPERBLOCK);
+}
+
+/*
+ * Write back whatever of SV's is dirty in the buffer cache: its data
+ * blocks, its indirect block, and its inode, which the caller should
+ * have synced into the cache already. Other files' dirty blocks are
+ * left for the flusher.
+ */
+int
+sfs_iflush(struct sfs_vnode *sv)
+{
+	/* Static, as in sfs_bmap. */
+	static uint32_t idbuf[SFS_DBPERIDB];
+
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t idblock;
+	uint32_t i;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (i=0; i<SFS_NDIRECT; i++) {
+		if (sv->sv_i.sfi_direct[i] != 0) {
+			result = sfs_iflush_block(sfs, sv->sv_i.sfi_direct[i]);
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	idblock = sv->sv_i.sfi_indirect;
+	if (idblock != 0) {
+		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		if (result) {
+			return result;
+		}
+		for (i=0; i<SFS_DBPERIDB; i++) {
+			if (idbuf[i] != 0) {
+				result = sfs_iflush_block(sfs, idbuf[i]);
+				if (result) {
+					return result;
+				}
+			}
+		}
+		result = sfs_iflush_block(sfs, idblock);
+		if (result) {
+			return result;
+		}
+	}
+
+	return sfs_iflush_block(sfs, sv->sv_ino);
+}
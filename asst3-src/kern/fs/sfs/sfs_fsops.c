@@ -41,6 +41,7 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -114,11 +115,15 @@ sfs_sync_vnodes(struct sfs_fs *sfs)
 {
 	unsigned i, num;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
+	/*
+	 * Go over the array of loaded vnodes, syncing as we go. This
+	 * only puts the inodes in the buffer cache; the whole cache is
+	 * written out at the end of sfs_sync.
+	 */
 	num = vnodearray_num(sfs->sfs_vnodes);
 	for (i=0; i<num; i++) {
 		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		sfs_sync_inode(v->vn_data);
 	}
 	return 0;
 }
@@ -229,6 +234,13 @@ sfs_sync(struct fs *fs)
 		return result;
 	}
 
+	/* Anything else still dirty in the buffer cache. */
+	result = buffer_sync_fs(fs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	vfs_biglock_release();
 	return 0;
 }
@@ -259,6 +271,7 @@ static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
 {
+	buffer_drop_fs(&sfs->sfs_absfs);
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
@@ -290,6 +303,9 @@ sfs_unmount(struct fs *fs)
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Forget our buffers, waiting out any read-ahead still going. */
+	buffer_drop_fs(fs);
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -309,6 +325,8 @@ static const struct fs_ops sfs_fsops = {
 	.fsop_getvolname = sfs_getvolname,
 	.fsop_getroot = sfs_getroot,
 	.fsop_unmount = sfs_unmount,
+	.fsop_readblock = sfs_devreadblock,
+	.fsop_writeblock = sfs_devwriteblock,
 };
 
 /*
@@ -328,6 +346,7 @@ sfs_fs_create(void)
 	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	COMPILE_ASSERT(SFS_BLOCKSIZE == BUF_SIZE);
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
@@ -35,10 +35,18 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <kmem.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * In-memory inodes come and go with every open and close, so they
+ * have a cache of their own.
+ */
+static struct kmem_cache sfs_vnode_cache =
+	KMEM_CACHE_INITIALIZER("sfs_vnode", struct sfs_vnode, NULL, NULL);
+
 
 /*
  * Write an on-disk inode structure back out to disk.
@@ -136,7 +144,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kmem_cache_free(&sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -184,7 +192,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = kmem_cache_alloc(&sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -198,7 +206,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -235,18 +243,21 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_ranextpos = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_ranextblock = 0;
 
 	/* Add it to our table */
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
+		kmem_cache_free(&sfs_vnode_cache, sv);
 		return result;
 	}
 
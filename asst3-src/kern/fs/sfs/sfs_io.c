@@ -38,18 +38,28 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+#define SFS_RAMIN	2	/* blocks read ahead when a stream starts */
+#define SFS_RAMAX	32	/* most blocks read ahead */
+
 ////////////////////////////////////////////////////////////
 //
 // Basic block-level I/O routines
 
+/*
+ * Note: sfs_rwblock is also called from the buffer cache's
+ * read-ahead thread, which doesn't hold vfs_biglock; it may only
+ * touch the device.
+ */
+
 /*
  * Note: sfs_readblock is used to read the superblock
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
- * except sfs_device.
+ * except sfs_device and sfs_absfs.
  */
 
 /*
@@ -62,8 +72,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -102,44 +110,94 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Read a block, or several consecutive blocks, from the device. This
+ * is fsop_readblock, used by the buffer cache; everything else goes
+ * through the cache.
  */
 int
-sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_devreadblock(struct fs *fs, daddr_t block, void *data, size_t len)
 {
+	struct sfs_fs *sfs = fs->fs_data;
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	uio_kinit(&iov, &ku, data, len, ((off_t)block)*SFS_BLOCKSIZE,
+		  UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
 /*
- * Write a block.
+ * Write a block, or several consecutive blocks, to the device. This
+ * is fsop_writeblock.
  */
 int
-sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_devwriteblock(struct fs *fs, daddr_t block, void *data, size_t len)
 {
+	struct sfs_fs *sfs = fs->fs_data;
 	struct iovec iov;
 	struct uio ku;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(len > 0 && len % SFS_BLOCKSIZE == 0);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	uio_kinit(&iov, &ku, data, len, ((off_t)block)*SFS_BLOCKSIZE,
+		  UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
 
+/*
+ * Read a block, through the buffer cache.
+ */
+int
+sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+
+	result = buffer_read(&sfs->sfs_absfs, block, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buffer_map(b), len);
+	buffer_release(b);
+	return 0;
+}
+
+/*
+ * Write a block, through the buffer cache, which puts it on disk
+ * later.
+ */
+int
+sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+
+	result = buffer_get(&sfs->sfs_absfs, block, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(b), data, len);
+	buffer_mark_valid(b);
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * need the original block in the buffer cache first, even if we're
+ * writing, so we don't clobber the portion of the block we're not
+ * intending to write over.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -150,16 +208,7 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
-	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *b;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,9 +218,6 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -184,40 +230,35 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sv->sv_absvn.vn_fs, diskblock, &b);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * (If a write fails partway, what got copied stays.)
+	 */
+	result = uiomove((char *)buffer_map(b) + skipstart, len, uio);
+
+	/*
+	 * If it was a write, the buffer now has the only copy.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		buffer_mark_dirty(b);
 	}
 
-	return 0;
+	buffer_release(b);
+	return result;
 }
 
 /*
@@ -227,15 +268,12 @@ static
 int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
-	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *b;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	bool wasvalid;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -257,34 +295,101 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
 
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(sv->sv_absvn.vn_fs, diskblock, &b);
+		if (result) {
+			return result;
+		}
+		result = uiomove(buffer_map(b), SFS_BLOCKSIZE, uio);
+		buffer_release(b);
+		return result;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
+	 * We're overwriting the whole block, so don't read it in if
+	 * it isn't cached.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
-
+	result = buffer_get(sv->sv_absvn.vn_fs, diskblock, &b);
+	if (result) {
+		return result;
+	}
+	wasvalid = buffer_isvalid(b);
+	result = uiomove(buffer_map(b), SFS_BLOCKSIZE, uio);
+	if (result == 0) {
+		buffer_mark_valid(b);
+		buffer_mark_dirty(b);
+	}
+	else if (wasvalid) {
+		/* What got copied stays, as in sfs_partialio. */
+		buffer_mark_dirty(b);
+	}
+	buffer_release(b);
 	return result;
 }
 
+/*
+ * Read-ahead. A read that starts where the last read of the file
+ * ended continues a stream; the number of blocks to read ahead
+ * starts at SFS_RAMIN and doubles with each such read, up to
+ * SFS_RAMAX. Any other read ends the stream and stops read-ahead.
+ * Blocks already asked for aren't asked for again, so in a steady
+ * stream each read queues about as many blocks as it used.
+ *
+ * Called after a successful read of STARTPOS to ENDPOS.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t startpos, off_t endpos)
+{
+	uint32_t fileblock, endblock, eofblock;
+	daddr_t diskblock;
+
+	if (startpos == sv->sv_ranextpos) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_ranextblock = 0;
+	}
+	sv->sv_ranextpos = endpos;
+	if (sv->sv_rawindow == 0) {
+		return;
+	}
+
+	/* From the first block we haven't read (or asked for) yet... */
+	fileblock = DIVROUNDUP(endpos, SFS_BLOCKSIZE);
+	if (fileblock < sv->sv_ranextblock) {
+		fileblock = sv->sv_ranextblock;
+	}
+
+	/* ...up to the window or EOF. */
+	endblock = DIVROUNDUP(endpos, SFS_BLOCKSIZE) + sv->sv_rawindow;
+	eofblock = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (endblock > eofblock) {
+		endblock = eofblock;
+	}
+
+	for (; fileblock < endblock; fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, &diskblock)) {
+			break;
+		}
+		/* Holes read as zeros anyway. */
+		if (diskblock != 0) {
+			buffer_readahead(sv->sv_absvn.vn_fs, diskblock);
+		}
+	}
+	if (fileblock > sv->sv_ranextblock) {
+		sv->sv_ranextblock = fileblock;
+	}
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
@@ -295,8 +400,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t origoffset;
 
 	origresid = uio->uio_resid;
+	origoffset = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -381,6 +488,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	/* If reading, get the next blocks coming */
+	if (result == 0 && uio->uio_rw == UIO_READ) {
+		sfs_readahead(sv, origoffset, uio->uio_offset);
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -406,7 +518,8 @@ int
 sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
-	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *b;
+	char *bdata;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,18 +527,6 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
 	blockoffset = actualpos % SFS_BLOCKSIZE;
@@ -446,26 +547,25 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = buffer_read(sv->sv_absvn.vn_fs, diskblock, &b);
 	if (result) {
 		return result;
 	}
+	bdata = buffer_map(b);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, bdata + blockoffset, len);
+		buffer_release(b);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
+		memcpy(bdata + blockoffset, data, len);
 
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* The cache writes the block back */
+		buffer_mark_dirty(b);
+		buffer_release(b);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
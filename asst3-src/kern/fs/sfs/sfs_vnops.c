@@ -123,6 +123,10 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	vfs_biglock_acquire();
 	result = sfs_io(sv, uio);
+	if (result == 0) {
+		/* Put any new size or blocks in the buffer cache too. */
+		result = sfs_sync_inode(sv);
+	}
 	vfs_biglock_release();
 
 	return result;
@@ -214,8 +218,9 @@ sfs_isseekable(struct vnode *v)
 }
 
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Called for fsync(). Gets this file onto the disk now, without
+ * waiting for the buffer cache to get round to it, and leaves
+ * everything else to the cache.
  */
 static
 int
@@ -226,20 +231,25 @@ sfs_fsync(struct vnode *v)
 
 	vfs_biglock_acquire();
 	result = sfs_sync_inode(sv);
+	if (result == 0) {
+		result = sfs_iflush(sv);
+	}
 	vfs_biglock_release();
 
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Any regular file can be mapped; the VM system
+ * reads and writes its pages through sfs_read and sfs_write, and so
+ * through the buffer cache like any other I/O.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
@@ -250,8 +260,16 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	vfs_biglock_acquire();
+	result = sfs_itrunc(sv, len);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	vfs_biglock_release();
 
-	return sfs_itrunc(sv, len);
+	return result;
 }
 
 /*
@@ -340,6 +358,14 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
 
+	/*
+	 * Hand both inodes to the buffer cache. If that fails they
+	 * stay dirty and go at the next sync; the file is made either
+	 * way.
+	 */
+	sfs_sync_inode(newguy);
+	sfs_sync_inode(sv);
+
 	*ret = &newguy->sv_absvn;
 
 	vfs_biglock_release();
@@ -380,6 +406,10 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
 
+	/* As in sfs_creat. */
+	sfs_sync_inode(f);
+	sfs_sync_inode(sv);
+
 	vfs_biglock_release();
 	return 0;
 }
@@ -412,6 +442,9 @@ sfs_remove(struct vnode *dir, const char *name)
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+
+		/* As in sfs_creat. */
+		sfs_sync_inode(victim);
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
@@ -484,6 +517,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
 
+	/* As in sfs_creat. */
+	sfs_sync_inode(g1);
+	sfs_sync_inode(sv);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 
@@ -51,6 +51,7 @@ int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+int sfs_iflush(struct sfs_vnode *sv);
 
 /* Functions in sfs_dir.c */
 int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
@@ -71,6 +72,8 @@ int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
+int sfs_devreadblock(struct fs *fs, daddr_t block, void *data, size_t len);
+int sfs_devwriteblock(struct fs *fs, daddr_t block, void *data, size_t len);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
@@ -36,16 +36,60 @@
 
 
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
 
 
+/*
+ * Region - a page-aligned range of virtual addresses the process is
+ * allowed to touch, with its access permissions. Pages inside a
+ * region are only given frames (and page table entries) when they
+ * are first faulted on.
+ *
+ * A region may be backed by a file: the RG_FILESIZE bytes starting at
+ * virtual address rg_filevaddr come from rg_vnode at rg_offset, and
+ * the rest of the region is zero-filled.
+ *
+ * A region made by mmap is RG_SHARED: it maps its file directly, so
+ * the part past the end of the file reads as zeros, and pages written
+ * go back to the file (on munmap, on exit, or when paged out) rather
+ * than to swap.
+ */
+struct region {
+        vaddr_t rg_vbase;               /* first address (page-aligned) */
+        size_t rg_npages;               /* length in pages */
+        unsigned rg_flags;              /* RG_* permissions */
+        struct vnode *rg_vnode;         /* backing file, or NULL */
+        off_t rg_offset;                /* file offset of rg_filevaddr */
+        vaddr_t rg_filevaddr;           /* where the file data starts */
+        size_t rg_filesize;             /* bytes of file data */
+        struct region *rg_next;
+};
+
+#define RG_READ         0x1
+#define RG_WRITE        0x2
+#define RG_EXEC         0x4
+#define RG_SHARED       0x8
+
+/* Size of the user stack region, in pages. Pages are allocated lazily. */
+#define VM_STACKPAGES   1024
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
  *
- * You write this.
+ * as_pt is the level-1 page table (see vm.c); as_lock protects it and
+ * the region list. as_cpus has a bit set for each CPU that has run
+ * the address space, and so may have its translations cached;
+ * as_asid[] is its TLB address space ID on each CPU (see vm.c).
+ *
+ * as_heap is the heap region, which starts just above the executable
+ * and which sbrk moves the top of; as_brk is the current break (not
+ * necessarily page-aligned). The heap region always covers the pages
+ * up to the break, and no more.
  */
 
 struct addrspace {
@@ -58,7 +102,13 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
+        paddr_t **as_pt;
+        struct region *as_regions;
+        struct lock *as_lock;
+        uint32_t as_cpus;
+        uint32_t as_asid[MAXCPUS];
+        struct region *as_heap;
+        vaddr_t as_brk;
 #endif
 };
 
@@ -99,6 +149,23 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_filedata - back the region containing VADDR with
+ *                FILESIZE bytes of file V, starting at OFFSET, to be
+ *                read in as the pages are touched.
+ *
+ *    as_findregion - return the region containing VADDR, or NULL.
+ *                Call with as_lock held.
+ *
+ *    as_sbrk   - move the heap break by AMOUNT bytes (which may be
+ *                negative), handing back the old break.
+ *
+ *    as_mmap   - map NPAGES pages of file V, starting at OFFSET, at
+ *                some free place in the address space, handing back
+ *                its address.
+ *
+ *    as_munmap - remove the mapping made by as_mmap at VADDR, writing
+ *                modified pages back to the file.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -117,6 +184,16 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_filedata(struct addrspace *as, vaddr_t vaddr,
+                                     size_t filesize,
+                                     struct vnode *v, off_t offset);
+struct region    *as_findregion(struct addrspace *as, vaddr_t vaddr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbrk);
+int               as_mmap(struct addrspace *as, size_t npages,
+                          int writeable, struct vnode *v, off_t offset,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr);
 
 
 /*
@@ -0,0 +1,74 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Block buffer cache.
+ *
+ * One cache of BUF_SIZE-byte disk blocks, shared by every mounted
+ * file system, that sits between the file system and its device. A
+ * buffer is named by the struct fs it belongs to and its block
+ * number; the cache does the I/O itself with FSOP_READBLOCK and
+ * FSOP_WRITEBLOCK, so only file systems that provide those can use
+ * it.
+ *
+ * Buffers are got with buffer_read (contents read in if they aren't
+ * cached) or buffer_get (for a block that is about to be entirely
+ * overwritten, so there's no point reading it), and are then held,
+ * locked, until buffer_release. Hold as few at once as possible:
+ * when every buffer is held, getting another waits.
+ *
+ * A buffer that has been changed is marked dirty. A background
+ * flusher thread writes dirty buffers back once they have been dirty
+ * for a few seconds, or sooner if too many are dirty, so writes
+ * normally cost no disk I/O at the time; buffer_writeout, buffer_flush
+ * and buffer_sync_fs are for when it must be on disk now. A dirty
+ * buffer is also written back when it is about to be reused for
+ * another block. Unheld buffers are reused least recently used first.
+ *
+ *    buffer_read      - get a buffer with the block's contents.
+ *    buffer_get       - get a buffer for the block; its contents are
+ *                       only meaningful if buffer_isvalid.
+ *    buffer_map       - the BUF_SIZE bytes of data.
+ *    buffer_isvalid   - whether the data is the block's contents.
+ *    buffer_mark_valid - the caller has filled in the data.
+ *    buffer_mark_dirty - the data is newer than the disk.
+ *    buffer_writeout  - write the buffer now if it's dirty.
+ *    buffer_release   - let go of the buffer.
+ *    buffer_readahead - start reading a block into the cache in the
+ *                       background, if it isn't cached already.
+ *    buffer_flush     - write a block now if it's cached and dirty.
+ *    buffer_invalidate - forget any cached copy of a block (dirty or
+ *                       not), e.g. because it has been freed.
+ *    buffer_sync_fs   - write back all of a file system's dirty buffers.
+ *    buffer_drop_fs   - forget all of a file system's buffers, which
+ *                       must be clean and unheld; for unmount.
+ */
+
+#include <fs.h>
+
+#define BUF_SIZE	512
+
+struct buf;	/* Opaque. */
+
+void buffer_bootstrap(void);
+
+int buffer_read(struct fs *fs, daddr_t block, struct buf **ret);
+int buffer_get(struct fs *fs, daddr_t block, struct buf **ret);
+void *buffer_map(struct buf *b);
+bool buffer_isvalid(struct buf *b);
+void buffer_mark_valid(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+int buffer_writeout(struct buf *b);
+void buffer_release(struct buf *b);
+
+void buffer_readahead(struct fs *fs, daddr_t block);
+int buffer_flush(struct fs *fs, daddr_t block);
+void buffer_invalidate(struct fs *fs, daddr_t block);
+int buffer_sync_fs(struct fs *fs);
+void buffer_drop_fs(struct fs *fs);
+
+/* Print hit rates and so on; with CLEAR, start counting afresh. */
+void buffer_printstats(bool clear);
+
+
+#endif /* _BUF_H_ */
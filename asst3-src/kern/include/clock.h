@@ -50,7 +50,8 @@ void hardclock(void);
 
 /*
  * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timed operations. (This is a fairly simpleminded interface.) Timed
+ * sleeps are now handled by hardclock instead.
  */
 void timerclock(void);
 
@@ -76,8 +77,16 @@ void timespec_sub(const struct timespec *t1,
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ *
+ * clocksleep_until() suspends execution until the time of day given,
+ * rounded up to the next clock tick.
+ *
+ * clocksleep_exact() is the same but wakes within a fraction of a
+ * tick of the time given, by yielding until then; it is for nanosleep.
  */
 void clocksleep(int seconds);
+void clocksleep_until(const struct timespec *when);
+void clocksleep_exact(const struct timespec *when);
 
 
 #endif /* _CLOCK_H_ */
@@ -36,6 +36,12 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Number of scheduler priority levels. Level 0 is the highest. See
+ * schedule() in thread.c.
+ */
+#define SCHED_NLEVELS	4
+
 /*
  * Per-cpu structure
  *
@@ -67,9 +73,17 @@ struct cpu {
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues, by priority */
+	volatile unsigned c_runcount;	/* Threads on c_runqueue[] */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus.
+	 * Protected by the thread pool lock.
+	 */
+	struct threadlist c_threadpool;	/* Dead threads kept for reuse */
+	struct spinlock c_threadpool_lock;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -82,10 +96,20 @@ struct cpu {
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
 	 * and vaddr pair, or a paddr, or something else.
+	 *
+	 * If the queue overflows, c_numshootdown goes one past
+	 * TLBSHOOTDOWN_MAX and the whole TLB is flushed instead.
+	 *
+	 * Each request queued gets the next ticket number from
+	 * c_shootdown_posted; c_shootdown_done is the last ticket
+	 * carried out. It is read without the lock by CPUs waiting
+	 * for their shootdowns to finish.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
+	unsigned c_shootdown_posted;
+	volatile unsigned c_shootdown_done;
 	struct spinlock c_ipi_lock;
 
 	/*
@@ -112,6 +136,12 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Number of CPUs; all of them are running once boot has called
+ * thread_start_cpus.
+ */
+unsigned cpu_count(void);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -155,6 +185,12 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * It returns a ticket that can be passed to ipi_tlbshootdown_wait.
+ * ipi_tlbshootdown_wait waits until TARGET has done the shootdown.
+ * ipi_tlbshootdown_cpus sends a shootdown to each CPU whose number
+ * is set in the bitmask CPUS, except the current one, and waits for
+ * them all. It spins; call it with interrupts off (so the current
+ * CPU is well-defined) and no spinlocks held.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -168,7 +204,10 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
+void ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
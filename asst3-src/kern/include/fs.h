@@ -51,6 +51,11 @@ struct fs {
  *      fsop_getvolname - Return volume name of filesystem.
  *      fsop_getroot    - Return root vnode of filesystem.
  *      fsop_unmount    - Attempt unmount of filesystem.
+ *      fsop_readblock  - Read a block from the device, for the buffer
+ *                        cache (see buf.h); or several consecutive
+ *                        blocks at once.
+ *      fsop_writeblock - Write a block or blocks to the device,
+ *                        likewise.
  *
  * fsop_getvolname may return NULL on filesystem types that don't
  * support the concept of a volume name. The string returned is
@@ -61,6 +66,9 @@ struct fs {
  * to make sure such changes don't cause name conflicts. So it probably
  * should be considered fixed.
  *
+ * fsop_readblock and fsop_writeblock may be NULL on filesystem types
+ * that don't use the buffer cache.
+ *
  * fsop_getroot should increment the refcount of the vnode returned.
  * It should not ever return NULL.
  *
@@ -74,6 +82,8 @@ struct fs_ops {
 	const char   *(*fsop_getvolname)(struct fs *);
 	int           (*fsop_getroot)(struct fs *, struct vnode **);
 	int           (*fsop_unmount)(struct fs *);
+	int           (*fsop_readblock)(struct fs *, daddr_t, void *, size_t);
+	int           (*fsop_writeblock)(struct fs *, daddr_t, void *, size_t);
 };
 
 /*
@@ -83,6 +93,10 @@ struct fs_ops {
 #define FSOP_GETVOLNAME(fs)  ((fs)->fs_ops->fsop_getvolname(fs))
 #define FSOP_GETROOT(fs, ret) ((fs)->fs_ops->fsop_getroot(fs, ret))
 #define FSOP_UNMOUNT(fs)     ((fs)->fs_ops->fsop_unmount(fs))
+#define FSOP_READBLOCK(fs, blk, data, len) \
+	((fs)->fs_ops->fsop_readblock(fs, blk, data, len))
+#define FSOP_WRITEBLOCK(fs, blk, data, len) \
+	((fs)->fs_ops->fsop_writeblock(fs, blk, data, len))
 
 /* Initialization functions for builtin fake file systems. */
 void semfs_bootstrap(void);
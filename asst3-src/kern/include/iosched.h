@@ -0,0 +1,79 @@
+#ifndef _IOSCHED_H_
+#define _IOSCHED_H_
+
+/*
+ * Block I/O scheduler.
+ *
+ * A disk driver with a request queue keeps it in a struct iosched,
+ * which decides what order the requests go to the disk in. Each
+ * request has a struct iosched_node giving where on the disk it is.
+ * iosched_add queues a request. When the disk is free, iosched_next
+ * hands back the one to do next, along with any queued requests that
+ * carry straight on from it (same direction, following sectors),
+ * chained through in_merged; the driver does them back to back as
+ * one transfer.
+ *
+ * The policy is picked by name, and may be changed at any time:
+ *
+ *    fifo     - arrival order.
+ *    clook    - C-LOOK elevator: up the disk from the head, then
+ *               back to the lowest request and up again.
+ *    deadline - C-LOOK, except that a read that has waited
+ *               IOSCHED_READEXPIRE ms, or a write that has waited
+ *               IOSCHED_WRITEEXPIRE ms, goes next.
+ *
+ * The driver does the locking: call iosched_add and iosched_next
+ * holding the spinlock given to iosched_init. iosched_setpolicy and
+ * iosched_printstats, which apply to every disk, take it themselves.
+ */
+
+#include <spinlock.h>
+
+#define IOSCHED_NAMELEN		16
+
+struct iosched_policy;	/* Opaque. */
+
+struct iosched_node {
+	/* Filled in by the driver */
+	uint32_t in_sector;		/* First sector */
+	uint32_t in_nsect;		/* Number of sectors */
+	bool in_write;
+	void *in_self;			/* The driver's request */
+
+	/* Private to the scheduler */
+	struct iosched_node *in_sortprev;	/* Queue in sector order */
+	struct iosched_node *in_sortnext;
+	struct iosched_node *in_fifoprev;	/* Queue in arrival order */
+	struct iosched_node *in_fifonext;
+	struct iosched_node *in_merged;		/* Rest of a merged run */
+	uint32_t in_deadline;			/* ms */
+};
+
+struct iosched {
+	char is_name[IOSCHED_NAMELEN];
+	struct spinlock *is_lock;
+	const struct iosched_policy *is_policy;
+	struct iosched_node is_queue;		/* List head for both orders */
+	unsigned is_count;			/* Requests queued */
+	uint32_t is_headpos;			/* Sector after the last done */
+	struct iosched *is_nextsched;		/* All of them, for the menu */
+
+	/* Stats */
+	unsigned long is_requests;		/* Requests done */
+	unsigned long is_transfers;		/* ... in this many runs */
+	unsigned long is_expired;		/* Runs started by a deadline */
+	uint64_t is_seekdist;			/* Sectors the head moved */
+};
+
+void iosched_init(struct iosched *is, const char *name, struct spinlock *lk);
+void iosched_add(struct iosched *is, struct iosched_node *in);
+struct iosched_node *iosched_next(struct iosched *is);
+
+/* Change every disk's policy; EINVAL if there's no such policy. */
+int iosched_setpolicy(const char *name);
+
+/* Print each disk's policy and seek distance; with CLEAR, start again. */
+void iosched_printstats(bool clear);
+
+
+#endif /* _IOSCHED_H_ */
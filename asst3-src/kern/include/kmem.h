@@ -0,0 +1,53 @@
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches (slab allocator).
+ *
+ * A kmem_cache hands out objects of one type. Objects are carved out
+ * of whole pages ("slabs") and are kept in their constructed state
+ * while free: the constructor runs once when a slab is made, and the
+ * destructor once when the slab is given back to the VM system, not
+ * on every kmem_cache_alloc/kmem_cache_free. So whatever the
+ * constructor sets up (locks, cvs, spinlocks, ...) is still there
+ * when an object comes back out of the cache, and an object must be
+ * returned to that state before it is freed.
+ *
+ * Either function may be NULL. The constructor returns 0 or an error
+ * code; if it fails, kmem_cache_alloc returns NULL.
+ *
+ * Caches are meant to be statically allocated, with
+ * KMEM_CACHE_INITIALIZER, so they can be used from the very start of
+ * boot:
+ *
+ *	static struct kmem_cache foo_cache =
+ *		KMEM_CACHE_INITIALIZER("foo", struct foo, foo_ctor, foo_dtor);
+ *
+ * Objects must be smaller than about half a page.
+ */
+
+#include <spinlock.h>
+
+struct kmem_slab;	/* Private. */
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	unsigned kc_perslab;		/* objects per slab; set on first use */
+	struct spinlock kc_lock;	/* protects the rest */
+	struct kmem_slab *kc_slabs;	/* partly used slabs */
+	struct kmem_slab *kc_empty;	/* wholly free slabs */
+	unsigned kc_nemptyslabs;	/* how many of those */
+};
+
+#define KMEM_CACHE_INITIALIZER(name, type, ctor, dtor) \
+	{ name, sizeof(type), ctor, dtor, 0, SPINLOCK_INITIALIZER, \
+	  NULL, NULL, 0 }
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+
+#endif /* _KMEM_H_ */
@@ -133,6 +133,12 @@ void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
 
+/*
+ * Give the page allocator back any pages that are free apart from
+ * blocks cached for reuse; returns how many. For alloc_kpages.
+ */
+unsigned kheap_drain(void);
+
 /*
  * C string functions.
  *
@@ -0,0 +1,50 @@
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * Lock contention profiler. Enable with "options lockprof" in the
+ * kernel config.
+ *
+ * For each spinlock, sleep lock and wait channel it counts the
+ * acquisitions (for a wait channel, the sleeps), how many of those
+ * had to wait, the total and longest wait, and (for locks) the total
+ * time held. Times come from the real-time clock, so nothing is
+ * recorded until lockprof_bootstrap runs after the clock is attached.
+ *
+ * The counts are kept per CPU, in a table indexed by the lock's
+ * address, and updated by each CPU with interrupts off and no lock
+ * at all. lockprof_dump adds the tables up and prints the locks with
+ * the most total wait. A lock that is destroyed and whose memory is
+ * reused for another lock shares its counts with it.
+ */
+
+#include "opt-lockprof.h"
+
+#if OPT_LOCKPROF
+
+#define LOCKPROF_SPINLOCK	0
+#define LOCKPROF_LOCK		1
+#define LOCKPROF_WCHAN		2
+
+void lockprof_bootstrap(void);
+
+/* Current time in ns, or 0 if not profiling yet. */
+uint64_t lockprof_now(void);
+
+/*
+ * Record that OBJ (of kind KIND, called NAME, acquired from SITE) was
+ * acquired after waiting from WAITSTART until NOW. If it didn't have
+ * to wait, WAITSTART is 0.
+ */
+void lockprof_acquired(const void *obj, unsigned kind, const char *name,
+		       const void *site, uint64_t waitstart, uint64_t now);
+
+/* Record that OBJ was released after being held since ACQTIME. */
+void lockprof_released(const void *obj, uint64_t acqtime);
+
+/* Print the most contended locks; then zero the counts if CLEAR. */
+void lockprof_dump(bool clear);
+
+#endif /* OPT_LOCKPROF */
+
+#endif /* _LOCKPROF_H_ */
@@ -56,6 +56,9 @@ struct sfs_vnode {
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	off_t sv_ranextpos;             /* where a sequential read starts */
+	uint32_t sv_rawindow;           /* blocks to read ahead, or 0 */
+	uint32_t sv_ranextblock;        /* first file block not read ahead */
 };
 
 /*
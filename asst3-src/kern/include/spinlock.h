@@ -37,6 +37,7 @@
 
 #include <cdefs.h>
 #include <hangman.h>
+#include <lockprof.h>
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -54,22 +55,38 @@
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
+ *
+ * These are ticket locks: a CPU wanting the lock takes the next
+ * number from splk_next and waits until splk_serving reaches it, so
+ * waiters get the lock in the order they arrived. Waiters only read
+ * splk_serving while they spin; it is written once per release.
  */
 struct spinlock {
-	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
-	struct cpu *splk_holder;	    /* CPU holding this lock. */
-	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
+	volatile spinlock_data_t splk_next;    /* Next ticket to hand out. */
+	volatile spinlock_data_t splk_serving; /* Ticket that holds the lock. */
+	struct cpu *splk_holder;	       /* CPU holding this lock. */
+	HANGMAN_LOCKABLE(splk_hangman);        /* Deadlock detector hook. */
+#if OPT_LOCKPROF
+	uint64_t splk_lptime;		       /* When acquired, for lockprof. */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
-				  HANGMAN_LOCKABLE_INITIALIZER }
+#if OPT_HANGMAN
+#define SPINLOCK_HANGMAN_INIT	, HANGMAN_LOCKABLE_INITIALIZER
+#else
+#define SPINLOCK_HANGMAN_INIT
+#endif
+#if OPT_LOCKPROF
+#define SPINLOCK_LOCKPROF_INIT	, 0
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_LOCKPROF_INIT
 #endif
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, NULL \
+				  SPINLOCK_HANGMAN_INIT SPINLOCK_LOCKPROF_INIT }
 
 /*
  * Spinlock functions.
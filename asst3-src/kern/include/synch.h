@@ -71,6 +71,11 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * Locks are adaptive: a thread that finds the lock held by a thread
+ * running on another CPU spins for a while before going to sleep.
+ * The counters record how often that paid off; lock_printstats (the
+ * "lks" menu command) shows them.
  */
 struct lock {
         char *lk_name;
@@ -78,6 +83,18 @@ struct lock {
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
         struct thread *volatile lk_holder;
+
+        /* Statistics, protected by lk_lock. */
+        unsigned lk_acquires;           /* times acquired */
+        unsigned lk_contended;          /* ...when already held */
+        unsigned lk_spinwins;           /* ...and got by spinning alone */
+        unsigned lk_sleeps;             /* times a waiter slept */
+        struct lock *lk_prev;           /* all locks, for the stats */
+        struct lock *lk_next;
+
+#if OPT_LOCKPROF
+        uint64_t lk_lptime;             /* when acquired, for lockprof */
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -89,6 +106,9 @@ void lock_destroy(struct lock *);
  *                   same time.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
+ *    lock_tryacquire - Get the lock if nobody holds it, without waiting.
+ *                   Returns true if the lock was acquired. Never sleeps,
+ *                   so it may be called with spinlocks held.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
  *                   false otherwise.
  *
@@ -96,8 +116,15 @@ void lock_destroy(struct lock *);
  */
 void lock_acquire(struct lock *);
 void lock_release(struct lock *);
+bool lock_tryacquire(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Print the statistics of every lock that has been contended; then
+ * zero them all if CLEAR.
+ */
+void lock_printstats(bool clear);
+
 
 /*
  * Condition variable.
@@ -140,4 +167,63 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers wait
+ * behind it, so a steady stream of readers can't starve writers. A
+ * consequence is that a thread holding the lock for reading must not
+ * acquire it for reading again.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+        char *rw_name;
+        struct wchan *rw_rwchan;        /* readers wait here */
+        struct wchan *rw_wwchan;        /* writers and upgraders wait here */
+        struct spinlock rw_lock;        /* protects the rest */
+        unsigned rw_readers;            /* number of readers holding it */
+        unsigned rw_writerswaiting;     /* number of writers asleep */
+        struct thread *rw_writer;       /* writer holding it, if any */
+        struct thread *rw_upgrader;     /* reader waiting to upgrade */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing.
+ *    rwlock_release_write - Give up a write hold. Only the writer
+ *                   holding the lock may do this.
+ *    rwlock_tryacquire_read, rwlock_tryacquire_write - Like the
+ *                   above, but return false instead of waiting. Never
+ *                   sleep, so may be called with spinlocks held.
+ *    rwlock_upgrade - Turn a read hold into a write hold, waiting for
+ *                   the other readers to leave. Only one reader can be
+ *                   upgrading at a time; if another already is, this
+ *                   returns false at once and the caller still holds
+ *                   the lock for reading (it should release it and
+ *                   start over, or the two would deadlock).
+ *    rwlock_downgrade - Turn a write hold into a read hold, without
+ *                   letting any other writer in between.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                   the lock for writing. (There's no such test for
+ *                   readers, which aren't recorded individually.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_tryacquire_read(struct rwlock *);
+bool rwlock_tryacquire_write(struct rwlock *);
+bool rwlock_upgrade(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -64,6 +64,7 @@ void exec_bootstrap(void);
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t user_req, userptr_t user_rem);
 
 int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_execv(userptr_t prog, userptr_t args);
@@ -92,4 +93,8 @@ int sys_fstat(int fd, userptr_t statptr);
 int sys_fsync(int fd);
 int sys_ftruncate(int fd, off_t len);
 
+int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_mmap(size_t length, int prot, int fd, off_t offset, int32_t *retval);
+int sys_munmap(userptr_t addr);
+
 #endif /* _SYSCALL_H_ */
@@ -73,6 +73,7 @@ struct thread {
 	char *t_name;			/* Name of this thread */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
 	threadstate_t t_state;		/* State this thread is in */
+	struct wchan *t_wchan;		/* Wait channel, if sleeping */
 
 	/*
 	 * Thread subsystem internal fields.
@@ -84,6 +85,9 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
+	unsigned t_priority;		/* Scheduler level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_lastran;		/* When last switched out */
 
 	/*
 	 * Interrupt state fields.
@@ -131,6 +135,9 @@ void thread_panic(void);
 /* Call during system shutdown to offline other CPUs. */
 void thread_shutdown(void);
 
+/* Free the dead threads kept for reuse; returns how many. */
+unsigned thread_pool_reclaim(void);
+
 /*
  * Make a new thread, which will start executing at "func". The thread
  * will belong to the process "proc", or to the current thread's
@@ -164,10 +171,11 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge the current thread for a clock tick and switch away from it
+ * if its time slice is up or a higher-priority thread is ready.
+ * Called from the timer interrupt.
  */
-void thread_consider_migration(void);
+void thread_timeslice(void);
 
 
 #endif /* _THREAD_H_ */
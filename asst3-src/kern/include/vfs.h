@@ -200,5 +200,18 @@ void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
 bool vfs_biglock_do_i_hold(void);
 
+/*
+ * Lock for the VFS name space: the list of known devices and the boot
+ * filesystem. Name lookups hold it for reading; adding devices,
+ * mounting, unmounting and changing the boot filesystem hold it for
+ * writing. It comes before vfs_biglock in the lock order, so a thread
+ * holding the big lock must not look up names.
+ */
+void vfs_namelock_acquire_read(void);
+void vfs_namelock_release_read(void);
+void vfs_namelock_acquire_write(void);
+void vfs_namelock_release_write(void);
+bool vfs_namelock_do_i_hold_write(void);
+
 
 #endif /* _VFS_H_ */
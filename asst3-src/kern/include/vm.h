@@ -39,6 +39,10 @@
 
 #include <machine/vm.h>
 
+struct addrspace;
+struct region;
+struct vnode;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -55,8 +59,102 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Frame table setup, in frametable.c; called from vm_bootstrap */
+void frametable_bootstrap(void);
+
+/*
+ * Reference counts on frames shared copy-on-write. free_kpages drops
+ * a reference and frees the frame when none are left.
+ */
+void frame_incref(paddr_t pa);
+unsigned frame_refcount(paddr_t pa);
+
+/* How many frames are free right now. */
+unsigned frame_freecount(void);
+
+/*
+ * Record a use of the frame at PA, mapped at VA in AS, for the page
+ * replacement clock. If AS is its only user, the frame becomes a
+ * candidate for page-out.
+ */
+void frame_touch(paddr_t pa, struct addrspace *as, vaddr_t va);
+
+/*
+ * Swap space, in swap.c.
+ *
+ *    swap_out  - write the page at KVA to a new swap slot.
+ *    swap_in   - read a swap slot into the page at KVA.
+ *    swap_free - release a swap slot.
+ */
+void swap_bootstrap(void);
+int swap_out(vaddr_t kva, unsigned *slot);
+int swap_in(unsigned slot, vaddr_t kva);
+void swap_free(unsigned slot);
+
+/*
+ * Page out the page at VA in AS, which is in the frame at PA, to swap
+ * (or just drop it if it can be read back from its file). Called by
+ * the frame table's replacement clock with as_lock held. Returns
+ * EBUSY for a modified page of a shared file mapping, which has to
+ * go to the page cleaner first.
+ */
+int vm_pageout(struct addrspace *as, vaddr_t va, paddr_t pa);
+
+/*
+ * For the page cleaner. vm_cleanprep, called with as_lock held,
+ * write-protects the page at VA in AS (in the frame at PA) if it is a
+ * modified page of a shared file mapping, and says where in which
+ * file (with a reference to the vnode) it belongs; EINVAL if it isn't
+ * one. vm_writefile then writes it there, with no locks held.
+ */
+int vm_cleanprep(struct addrspace *as, vaddr_t va, paddr_t pa,
+                 struct vnode **vn, off_t *pos);
+int vm_writefile(struct vnode *vn, off_t pos, vaddr_t kva);
+
+/*
+ * Write the modified pages of shared file mapping RG in AS back to
+ * the file. Call with as_lock held.
+ */
+int vm_syncregion(struct addrspace *as, struct region *rg);
+
+/* Invalidate this CPU's TLB entry for VA in AS, if any */
+void vm_tlbinvalidate(struct addrspace *as, vaddr_t va);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+ * TLB shootdown, in vm.c.
+ *
+ *    vm_tlbactivate    - load AS on this CPU (from as_activate).
+ *    vm_tlbdeactivate  - unload it (from as_deactivate).
+ *    vm_shootdown_init - start an empty batch of pages of AS.
+ *    vm_shootdown_add  - add the page at VA to the batch.
+ *    vm_shootdown_send - invalidate the batch on every CPU that has
+ *                        run AS, and wait for them.
+ */
+void vm_tlbactivate(struct addrspace *as);
+void vm_tlbdeactivate(void);
+void vm_shootdown_init(struct tlbshootdown *ts, struct addrspace *as);
+void vm_shootdown_add(struct tlbshootdown *ts, vaddr_t va);
+void vm_shootdown_send(struct tlbshootdown *ts);
+
+/* Invalidate every entry in this CPU's TLB */
+void vm_tlbflush(void);
+
+/*
+ * Page table functions in vm.c, used by the address space code.
+ *
+ *    pt_create   - allocate an empty (level-1) page table for AS.
+ *    pt_destroy  - free the page table and every frame it maps.
+ *    pt_copy     - share every resident page of OLD with NEW,
+ *                  copy-on-write.
+ *    pt_unmap    - drop NPAGES pages at VA, freeing their frames.
+ */
+int pt_create(struct addrspace *as);
+void pt_destroy(struct addrspace *as);
+int pt_copy(struct addrspace *old, struct addrspace *new);
+void pt_unmap(struct addrspace *as, vaddr_t va, size_t npages);
+
 
 #endif /* _VM_H_ */
@@ -46,7 +46,9 @@
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <pid.h>
+#include <lockprof.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -128,9 +130,13 @@ boot(void)
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	buffer_bootstrap();
 	kprintf_bootstrap();
 	exec_bootstrap();
 	thread_start_cpus();
+#if OPT_LOCKPROF
+	lockprof_bootstrap();
+#endif
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
@@ -41,8 +41,11 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include <pid.h>
+#include <lockprof.h>
+#include <iosched.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-sfs.h"
@@ -471,6 +474,96 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	bool clear = false;
+
+	if (nargs == 2 && !strcmp(args[1], "-c")) {
+		clear = true;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: bc [-c]\n");
+		return EINVAL;
+	}
+
+	buffer_printstats(clear);
+
+	return 0;
+}
+
+/*
+ * Command for the disks' I/O schedulers. With a policy name, switch
+ * to it; otherwise print seek stats.
+ */
+static
+int
+cmd_iosched(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		iosched_printstats(false);
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "-c")) {
+		iosched_printstats(true);
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: ios [-c | fifo | clook | deadline]\n");
+		return EINVAL;
+	}
+
+	result = iosched_setpolicy(args[1]);
+	if (result) {
+		kprintf("ios: No policy %s\n", args[1]);
+		return result;
+	}
+	return 0;
+}
+
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	bool clear = false;
+
+	if (nargs == 2 && !strcmp(args[1], "-c")) {
+		clear = true;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: lks [-c]\n");
+		return EINVAL;
+	}
+
+	lock_printstats(clear);
+
+	return 0;
+}
+
+#if OPT_LOCKPROF
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	bool clear = false;
+
+	if (nargs == 2 && !strcmp(args[1], "-c")) {
+		clear = true;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: lp [-c]\n");
+		return EINVAL;
+	}
+
+	lockprof_dump(clear);
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -576,6 +669,9 @@ static const char *testmenu[] = {
 	"[sy2] Lock test                     ",
 	"[sy3] CV test                       ",
 	"[sy4] CV test #2                    ",
+	"[rwt1] Reader-writer lock test      ",
+	"[rwt2] Reader-writer lock scaling   ",
+	"[splk] Spinlock benchmark           ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[wt]  waitpid test                  ",
 	"[fs1] Filesystem test               ",
@@ -604,6 +700,12 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[bc] Buffer cache stats             ",
+	"[ios] Disk scheduler stats/policy   ",
+	"[lks] Lock spin/sleep stats         ",
+#if OPT_LOCKPROF
+	"[lp] Lock contention stats          ",
+#endif
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
 	"[q] Quit and shut down              ",
@@ -655,6 +757,12 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "bc",         cmd_bufstats },
+	{ "ios",        cmd_iosched },
+	{ "lks",        cmd_lockstats },
+#if OPT_LOCKPROF
+	{ "lp",         cmd_lockprof },
+#endif
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
 
@@ -679,6 +787,9 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "rwt1",	rwtest },
+	{ "rwt2",	rwtest2 },
+	{ "splk",	spinlocktest },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
@@ -46,6 +46,7 @@
 #include <kern/errno.h>
 #include <spl.h>
 #include <synch.h>
+#include <kmem.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -58,6 +59,39 @@
  */
 struct proc *kproc;
 
+/*
+ * Cache of proc structures. p_threadslock, p_threads, and p_lock are
+ * set up once per object rather than once per process.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->p_threadslock = lock_create("p_threads");
+	if (proc->p_threadslock == NULL) {
+		return ENOMEM;
+	}
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_cleanup(&proc->p_lock);
+	threadarray_cleanup(&proc->p_threads);
+	lock_destroy(proc->p_threadslock);
+}
+
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", struct proc, proc_ctor, proc_dtor);
+
 /*
  * Create a proc structure.
  */
@@ -67,25 +101,17 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
-		return NULL;
-	}
-
-	proc->p_threadslock = lock_create("p_threads");
-	if (proc->p_threadslock == NULL) {
-		kfree(proc->p_name);
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
-	threadarray_init(&proc->p_threads);
 
-	spinlock_init(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 	proc->p_pid = INVALID_PID;
 
 	/* VM fields */
@@ -183,12 +209,10 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_pid == INVALID_PID);
-	spinlock_cleanup(&proc->p_lock);
-	threadarray_cleanup(&proc->p_threads);
-	lock_destroy(proc->p_threadslock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 }
 
 /*
@@ -36,9 +36,42 @@
 #include <kern/fcntl.h>
 #include <lib.h>
 #include <synch.h>
+#include <kmem.h>
 #include <vfs.h>
 #include <openfile.h>
 
+/*
+ * Cache constructor and destructor: the offset lock and refcount
+ * spinlock live as long as the memory does.
+ */
+static
+int
+openfile_ctor(void *obj)
+{
+	struct openfile *file = obj;
+
+	file->of_offsetlock = lock_create("openfile");
+	if (file->of_offsetlock == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&file->of_reflock);
+	return 0;
+}
+
+static
+void
+openfile_dtor(void *obj)
+{
+	struct openfile *file = obj;
+
+	spinlock_cleanup(&file->of_reflock);
+	lock_destroy(file->of_offsetlock);
+}
+
+static struct kmem_cache openfile_cache =
+	KMEM_CACHE_INITIALIZER("openfile", struct openfile,
+			       openfile_ctor, openfile_dtor);
+
 /*
  * Constructor for struct openfile.
  */
@@ -53,19 +86,11 @@ openfile_create(struct vnode *vn, int accmode)
 		accmode == O_WRONLY ||
 		accmode == O_RDWR);
 
-	file = kmalloc(sizeof(struct openfile));
+	file = kmem_cache_alloc(&openfile_cache);
 	if (file == NULL) {
 		return NULL;
 	}
 
-	file->of_offsetlock = lock_create("openfile");
-	if (file->of_offsetlock == NULL) {
-		kfree(file);
-		return NULL;
-	}
-
-	spinlock_init(&file->of_reflock);
-
 	file->of_vnode = vn;
 	file->of_accmode = accmode;
 	file->of_offset = 0;
@@ -85,9 +110,7 @@ openfile_destroy(struct openfile *file)
 	/* balance vfs_open with vfs_close (not VOP_DECREF) */
 	vfs_close(file->of_vnode);
 
-	spinlock_cleanup(&file->of_reflock);
-	lock_destroy(file->of_offsetlock);
-	kfree(file);
+	kmem_cache_free(&openfile_cache, file);
 }
 
 /*
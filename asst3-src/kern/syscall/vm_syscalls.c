@@ -0,0 +1,113 @@
+/*
+ * VM-related system calls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <addrspace.h>
+#include <syscall.h>
+
+/* Protection bits for mmap, as in <unistd.h>. */
+#define PROT_READ	1
+#define PROT_WRITE	2
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes and return where it
+ * used to be.
+ */
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbrk;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	result = as_sbrk(as, amount, &oldbrk);
+	if (result) {
+		return result;
+	}
+	*retval = (int32_t)oldbrk;
+	return 0;
+}
+
+/*
+ * mmap: map LENGTH bytes of file FD, from OFFSET (page-aligned), into
+ * the address space. All mappings are shared: stores go back to the
+ * file. Returns the address of the mapping.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, int32_t *retval)
+{
+	struct addrspace *as;
+	struct openfile *file;
+	size_t npages;
+	vaddr_t addr;
+	int result;
+
+	if (length == 0 || offset < 0 || offset % PAGE_SIZE != 0 ||
+	    (prot & ~(PROT_READ | PROT_WRITE)) != 0) {
+		return EINVAL;
+	}
+	npages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages == 0) {
+		/* Length wrapped. */
+		return ENOMEM;
+	}
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	/* We always need to read the file, and to write it for PROT_WRITE. */
+	if (file->of_accmode == O_WRONLY ||
+	    ((prot & PROT_WRITE) && file->of_accmode != O_RDWR)) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EACCES;
+	}
+
+	result = VOP_MMAP(file->of_vnode);
+	if (result == 0) {
+		result = as_mmap(as, npages, prot & PROT_WRITE,
+				 file->of_vnode, offset, &addr);
+	}
+	filetable_put(curproc->p_filetable, fd, file);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)addr;
+	return 0;
+}
+
+/*
+ * munmap: remove the mapping at ADDR, writing back what was modified.
+ */
+int
+sys_munmap(userptr_t addr)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_munmap(as, (vaddr_t)addr);
+}
@@ -0,0 +1,330 @@
+/*
+ * Reader-writer lock tests.
+ *
+ * rwt1 is a stress test: a crowd of threads take the lock every way
+ * there is (read, write, try, upgrade, downgrade) and check that no
+ * reader ever sees a writer and no two writers meet. It finishes only
+ * if writers aren't starved.
+ *
+ * rwt2 measures how read-side throughput scales with the number of
+ * threads, against a plain lock doing the same work.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define NRWLOOPS	200
+#define NRWTHREADS	32
+#define NSCALELOOPS	2000
+#define MAXSCALETHREADS	16
+#define READWORK	200	/* busy loop inside the read section */
+
+static struct rwlock *testrw;
+static struct lock *testlock;
+static struct semaphore *donesem;
+
+/* Who is inside, protected by inlock. */
+static struct spinlock inlock = SPINLOCK_INITIALIZER;
+static unsigned readersin, writersin;
+static volatile unsigned long testval1, testval2;
+static volatile bool testfailed;
+
+static
+void
+inititems(void)
+{
+	if (testrw == NULL) {
+		testrw = rwlock_create("testrw");
+		if (testrw == NULL) {
+			panic("rwtest: rwlock_create failed\n");
+		}
+	}
+	if (testlock == NULL) {
+		testlock = lock_create("testlock");
+		if (testlock == NULL) {
+			panic("rwtest: lock_create failed\n");
+		}
+	}
+	if (donesem == NULL) {
+		donesem = sem_create("donesem", 0);
+		if (donesem == NULL) {
+			panic("rwtest: sem_create failed\n");
+		}
+	}
+}
+
+static
+void
+fail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	testfailed = true;
+}
+
+/*
+ * Record entering or leaving the lock as a reader or writer, and
+ * check nobody else is in who shouldn't be.
+ */
+static
+void
+enter(unsigned long num, bool write)
+{
+	spinlock_acquire(&inlock);
+	if (write) {
+		if (readersin > 0 || writersin > 0) {
+			fail(num, "writer got in with others inside");
+		}
+		writersin++;
+	}
+	else {
+		if (writersin > 0) {
+			fail(num, "reader got in with a writer inside");
+		}
+		readersin++;
+	}
+	spinlock_release(&inlock);
+}
+
+static
+void
+leave(bool write)
+{
+	spinlock_acquire(&inlock);
+	if (write) {
+		KASSERT(writersin == 1);
+		writersin--;
+	}
+	else {
+		KASSERT(readersin > 0);
+		readersin--;
+	}
+	spinlock_release(&inlock);
+}
+
+static
+void
+checkvals(unsigned long num)
+{
+	if (testval2 != testval1 * testval1) {
+		fail(num, "saw a half-done write");
+	}
+}
+
+static
+void
+setvals(unsigned long num)
+{
+	testval1 = num;
+	thread_yield();
+	testval2 = num * num;
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		switch ((i + num) % 8) {
+		    case 0:
+			/* write */
+			rwlock_acquire_write(testrw);
+			enter(num, true);
+			setvals(num);
+			leave(true);
+			rwlock_release_write(testrw);
+			break;
+		    case 1:
+			/* try to write */
+			if (rwlock_tryacquire_write(testrw)) {
+				enter(num, true);
+				setvals(num);
+				leave(true);
+				rwlock_release_write(testrw);
+			}
+			break;
+		    case 2:
+			/* write, then downgrade and look */
+			rwlock_acquire_write(testrw);
+			enter(num, true);
+			setvals(num);
+			leave(true);
+			rwlock_downgrade(testrw);
+			enter(num, false);
+			if (testval1 != num) {
+				fail(num, "write lost across downgrade");
+			}
+			checkvals(num);
+			leave(false);
+			rwlock_release_read(testrw);
+			break;
+		    case 3:
+			/* read, then upgrade and write */
+			rwlock_acquire_read(testrw);
+			enter(num, false);
+			checkvals(num);
+			leave(false);
+			if (rwlock_upgrade(testrw)) {
+				enter(num, true);
+				setvals(num);
+				leave(true);
+				rwlock_release_write(testrw);
+			}
+			else {
+				rwlock_release_read(testrw);
+			}
+			break;
+		    case 4:
+			/* try to read */
+			if (rwlock_tryacquire_read(testrw)) {
+				enter(num, false);
+				checkvals(num);
+				leave(false);
+				rwlock_release_read(testrw);
+			}
+			break;
+		    default:
+			/* read */
+			rwlock_acquire_read(testrw);
+			enter(num, false);
+			checkvals(num);
+			thread_yield();
+			checkvals(num);
+			leave(false);
+			rwlock_release_read(testrw);
+			break;
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting rwlock test...\n");
+
+	testfailed = false;
+	testval1 = testval2 = 0;
+
+	for (i=0; i<NRWTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NRWTHREADS; i++) {
+		P(donesem);
+	}
+
+	KASSERT(readersin == 0 && writersin == 0);
+	kprintf("rwlock test %s.\n", testfailed ? "FAILED" : "done");
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Scaling
+
+static
+void
+readwork(void)
+{
+	volatile int j;
+
+	for (j=0; j<READWORK; j++);
+}
+
+static
+void
+rwscalethread(void *junk, unsigned long userw)
+{
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NSCALELOOPS; i++) {
+		if (userw) {
+			rwlock_acquire_read(testrw);
+			readwork();
+			rwlock_release_read(testrw);
+		}
+		else {
+			lock_acquire(testlock);
+			readwork();
+			lock_release(testlock);
+		}
+	}
+	V(donesem);
+}
+
+/*
+ * Run NTHREADS threads doing NSCALELOOPS read sections each and
+ * return the nanoseconds per section.
+ */
+static
+uint64_t
+rwscale(unsigned nthreads, bool userw)
+{
+	struct timespec before, after;
+	unsigned i;
+	int result;
+
+	gettime(&before);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("rwscale", NULL, rwscalethread,
+				     NULL, userw);
+		if (result) {
+			panic("rwtest2: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(donesem);
+	}
+	gettime(&after);
+
+	timespec_sub(&after, &before, &after);
+	return ((uint64_t)after.tv_sec * 1000000000 + after.tv_nsec) /
+		((uint64_t)nthreads * NSCALELOOPS);
+}
+
+int
+rwtest2(int nargs, char **args)
+{
+	unsigned n;
+	uint64_t rwns, lockns;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting rwlock scaling test...\n");
+
+	for (n=1; n<=MAXSCALETHREADS; n*=2) {
+		rwns = rwscale(n, true);
+		lockns = rwscale(n, false);
+		kprintf("%2u threads: rwlock %llu ns/read, lock %llu ns/read\n",
+			n, (unsigned long long)rwns,
+			(unsigned long long)lockns);
+	}
+
+	kprintf("rwlock scaling test done.\n");
+
+	return 0;
+}
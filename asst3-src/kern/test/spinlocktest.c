@@ -0,0 +1,223 @@
+/*
+ * Spinlock contention benchmark.
+ *
+ * One thread per CPU hammers a single spinlock for SPLK_SECONDS,
+ * doing a little work while holding it. Afterwards we print how many
+ * times each thread got the lock, the time per acquisition, and two
+ * measures of fairness: Jain's index over the per-thread counts
+ * (100% when everyone got the same share) and the longest run of
+ * back-to-back acquisitions by the same thread.
+ *
+ * There is no cycle counter to time single acquisitions with, so
+ * latency is given as the average time per acquire/release, first
+ * uncontended and then with every CPU competing.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define SPLK_SECONDS		2
+#define SPLK_UNCONTENDED	100000	/* acquires for the solo run */
+#define SPLK_CHECKEVERY		256	/* acquires between clock checks */
+#define SPLK_WORK		20	/* busy loop while holding the lock */
+#define SPLK_MAXTHREADS		32
+
+struct splkstat {
+	unsigned long ss_count;		/* acquisitions */
+	unsigned long ss_maxrun;	/* longest back-to-back run */
+	unsigned ss_cpu;		/* CPU it finished on */
+};
+
+static struct spinlock testsplk = SPINLOCK_INITIALIZER;
+static struct splkstat stats[SPLK_MAXTHREADS];
+static struct semaphore *readysem;
+static struct semaphore *donesem;
+static volatile bool go;
+static struct timespec stoptime;
+
+/* Protected by testsplk. */
+static volatile unsigned long lastholder;
+static volatile unsigned long run;
+static volatile unsigned long shared;
+
+static
+void
+inititems(void)
+{
+	if (readysem == NULL) {
+		readysem = sem_create("splk ready", 0);
+		if (readysem == NULL) {
+			panic("spinlocktest: sem_create failed\n");
+		}
+	}
+	if (donesem == NULL) {
+		donesem = sem_create("splk done", 0);
+		if (donesem == NULL) {
+			panic("spinlocktest: sem_create failed\n");
+		}
+	}
+}
+
+static
+uint64_t
+timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static
+void
+holdwork(void)
+{
+	volatile int j;
+
+	for (j=0; j<SPLK_WORK; j++);
+}
+
+static
+void
+splkthread(void *junk, unsigned long num)
+{
+	struct splkstat *ss = &stats[num];
+	struct timespec now;
+	unsigned i;
+
+	(void)junk;
+
+	V(readysem);
+	while (!go) {
+		thread_yield();
+	}
+
+	while (1) {
+		for (i=0; i<SPLK_CHECKEVERY; i++) {
+			spinlock_acquire(&testsplk);
+			if (lastholder == num) {
+				run++;
+			}
+			else {
+				lastholder = num;
+				run = 1;
+			}
+			if (run > ss->ss_maxrun) {
+				ss->ss_maxrun = run;
+			}
+			shared++;
+			holdwork();
+			spinlock_release(&testsplk);
+		}
+		ss->ss_count += SPLK_CHECKEVERY;
+
+		gettime(&now);
+		if (timespec_ns(&now) >= timespec_ns(&stoptime)) {
+			break;
+		}
+	}
+
+	ss->ss_cpu = curcpu->c_number;
+	V(donesem);
+}
+
+int
+spinlocktest(int nargs, char **args)
+{
+	struct timespec start, end;
+	unsigned nthreads, i;
+	unsigned long total, min, max;
+	uint64_t ns, sum, sumsq;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+
+	nthreads = cpu_count();
+	if (nthreads > SPLK_MAXTHREADS) {
+		nthreads = SPLK_MAXTHREADS;
+	}
+
+	kprintf("Starting spinlock benchmark...\n");
+
+	/* Uncontended. */
+	gettime(&start);
+	for (i=0; i<SPLK_UNCONTENDED; i++) {
+		spinlock_acquire(&testsplk);
+		holdwork();
+		spinlock_release(&testsplk);
+	}
+	gettime(&end);
+	timespec_sub(&end, &start, &end);
+	kprintf("Uncontended: %llu ns per acquire/release\n",
+		(unsigned long long)(timespec_ns(&end) / SPLK_UNCONTENDED));
+
+	/* Contended. */
+	bzero(stats, sizeof(stats));
+	lastholder = (unsigned long)-1;
+	run = 0;
+	shared = 0;
+	go = false;
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("splktest", NULL, splkthread, NULL, i);
+		if (result) {
+			panic("spinlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(readysem);
+	}
+	gettime(&start);
+	stoptime = start;
+	stoptime.tv_sec += SPLK_SECONDS;
+	go = true;
+	for (i=0; i<nthreads; i++) {
+		P(donesem);
+	}
+	gettime(&end);
+	timespec_sub(&end, &start, &end);
+	ns = timespec_ns(&end);
+
+	total = 0;
+	min = max = stats[0].ss_count;
+	sum = sumsq = 0;
+	for (i=0; i<nthreads; i++) {
+		kprintf("  thread %2u (cpu%u): %lu acquires, "
+			"longest run %lu\n", i, stats[i].ss_cpu,
+			stats[i].ss_count, stats[i].ss_maxrun);
+		total += stats[i].ss_count;
+		if (stats[i].ss_count < min) {
+			min = stats[i].ss_count;
+		}
+		if (stats[i].ss_count > max) {
+			max = stats[i].ss_count;
+		}
+		sum += stats[i].ss_count;
+		sumsq += (uint64_t)stats[i].ss_count * stats[i].ss_count;
+	}
+
+	if (total != shared) {
+		kprintf("Lost updates: %lu acquires but count is %lu\n",
+			total, shared);
+		kprintf("Test failed\n");
+		return 0;
+	}
+
+	/* Jain's index, sum^2 / (n * sum of squares), as a percentage. */
+	kprintf("%u threads: %llu ns per acquire/release, "
+		"min/max %lu/%lu, fairness %llu%%\n", nthreads,
+		(unsigned long long)(total ? ns / total : 0), min, max,
+		(unsigned long long)(sumsq ?
+		   (sum * sum * 100) / (nthreads * sumsq) : 100));
+	kprintf("Spinlock benchmark done.\n");
+
+	return 0;
+}
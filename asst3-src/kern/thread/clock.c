@@ -30,10 +30,12 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <platform/maxcpus.h>
 
 /*
  * Time handling.
@@ -50,14 +52,52 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	100	/* Reset priorities every 100 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Timer wheels.
+ *
+ * Each CPU has a hierarchical timer wheel of sleeping threads, driven
+ * by its hardclock. A sleeper puts a struct timeout (on its own stack)
+ * in a slot of the wheel of whatever CPU it is on and waits on that
+ * wheel's wchan; the hardclock wakes just the threads whose timeouts
+ * are due, so a tick costs O(expired), not O(sleepers).
+ *
+ * Level 0 has one slot per tick for the next TW_SLOTS ticks. Each
+ * slot of level L covers TW_SLOTS^L ticks; when level 0 comes round
+ * to slot 0, the next slot of level 1 is "cascaded" (its timeouts
+ * are re-inserted, landing in level 0), and likewise up the levels.
+ * Timeouts further off than the wheel can hold are cut short; the
+ * sleeper just goes back to sleep.
+ *
+ * The wheel only works in whole ticks. clocksleep_until rounds up to
+ * the next one. clocksleep_exact, for nanosleep, instead rechecks the
+ * time of day when woken and yields its way through whatever is left
+ * of the last tick, so sleeps are accurate to better than a tick; the
+ * kernel's own sleepers don't need that and shouldn't pay for it.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+
+#define TW_BITS		6
+#define TW_SLOTS	(1U << TW_BITS)
+#define TW_MASK		(TW_SLOTS - 1)
+#define TW_LEVELS	4
+#define TW_MAXTICKS	((1U << (TW_BITS * TW_LEVELS)) - 1)
+
+struct timeout {
+	struct timeout *to_next;	/* next in slot */
+	struct thread *to_thread;	/* who is sleeping */
+	unsigned to_expires;		/* tick to wake at */
+	bool to_fired;			/* set when woken */
+};
+
+struct timerwheel {
+	struct spinlock tw_lock;
+	struct wchan *tw_wchan;		/* sleepers wait here */
+	unsigned tw_now;		/* ticks done so far */
+	struct timeout *tw_slots[TW_LEVELS][TW_SLOTS];
+};
+
+static struct timerwheel timerwheels[MAXCPUS];
 
 /*
  * Setup.
@@ -65,24 +105,89 @@ static struct spinlock lbolt_lock;
 void
 hardclock_bootstrap(void)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_init(&timerwheels[i].tw_lock);
+		timerwheels[i].tw_wchan = wchan_create("clocksleep");
+		if (timerwheels[i].tw_wchan == NULL) {
+			panic("Couldn't create timer wheel wchan\n");
+		}
+	}
+}
+
+/*
+ * Put TO in the right slot of TW. Call with tw_lock held.
+ */
+static
+void
+timerwheel_insert(struct timerwheel *tw, struct timeout *to)
+{
+	unsigned delta, level, slot;
+
+	delta = to->to_expires - tw->tw_now;
+	KASSERT(delta <= TW_MAXTICKS);
+
+	for (level=0; level<TW_LEVELS-1; level++) {
+		if (delta < (1U << (TW_BITS * (level + 1)))) {
+			break;
+		}
 	}
+	slot = (to->to_expires >> (TW_BITS * level)) & TW_MASK;
+	to->to_next = tw->tw_slots[level][slot];
+	tw->tw_slots[level][slot] = to;
+}
+
+/*
+ * Advance this CPU's wheel by one tick and wake whoever is due.
+ */
+static
+void
+timerwheel_tick(void)
+{
+	struct timerwheel *tw;
+	struct timeout *to, *next;
+	unsigned level, slot;
+
+	tw = &timerwheels[curcpu->c_number];
+	spinlock_acquire(&tw->tw_lock);
+	tw->tw_now++;
+
+	/* Cascade each level whose lower level has just wrapped. */
+	for (level=1; level<TW_LEVELS; level++) {
+		if ((tw->tw_now & ((1U << (TW_BITS * level)) - 1)) != 0) {
+			break;
+		}
+		slot = (tw->tw_now >> (TW_BITS * level)) & TW_MASK;
+		to = tw->tw_slots[level][slot];
+		tw->tw_slots[level][slot] = NULL;
+		for (; to != NULL; to = next) {
+			next = to->to_next;
+			timerwheel_insert(tw, to);
+		}
+	}
+
+	slot = tw->tw_now & TW_MASK;
+	to = tw->tw_slots[0][slot];
+	tw->tw_slots[0][slot] = NULL;
+	for (; to != NULL; to = next) {
+		next = to->to_next;
+		KASSERT(to->to_expires == tw->tw_now);
+		to->to_fired = true;
+		wchan_wakethread(tw->tw_wchan, to->to_thread, &tw->tw_lock);
+	}
+
+	spinlock_release(&tw->tw_lock);
 }
 
 /*
  * This is called once per second, on one processor, by the timer
- * code.
+ * code. There is nothing for it to do any more; sleeping is done
+ * with the per-CPU timer wheels.
  */
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
 }
 
 /*
@@ -97,13 +202,80 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
-	}
+	timerwheel_tick();
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	thread_timeslice();
+}
+
+/*
+ * Suspend execution until the time of day reaches WHEN. If EXACT,
+ * spin (yielding) through the last part of a tick; otherwise round
+ * up to a whole tick.
+ */
+static
+void
+clocksleep_common(const struct timespec *when, bool exact)
+{
+	struct timespec now, left;
+	struct timerwheel *tw;
+	struct timeout to;
+	unsigned ticks;
+
+	while (1) {
+		gettime(&now);
+		if (now.tv_sec > when->tv_sec ||
+		    (now.tv_sec == when->tv_sec &&
+		     now.tv_nsec >= when->tv_nsec)) {
+			return;
+		}
+		timespec_sub(when, &now, &left);
+
+		if (left.tv_sec >= TW_MAXTICKS / HZ) {
+			ticks = TW_MAXTICKS;
+		}
+		else if (exact) {
+			ticks = left.tv_sec * HZ +
+				left.tv_nsec / (1000000000 / HZ);
+		}
+		else {
+			ticks = left.tv_sec * HZ +
+				DIVROUNDUP(left.tv_nsec, 1000000000 / HZ);
+		}
+		if (ticks == 0) {
+			/* Less than a tick to go. */
+			thread_yield();
+			continue;
+		}
+
+		/*
+		 * If we move to another CPU between here and taking
+		 * the lock it doesn't matter; any CPU's wheel will do.
+		 */
+		tw = &timerwheels[curcpu->c_number];
+		spinlock_acquire(&tw->tw_lock);
+		to.to_thread = curthread;
+		to.to_expires = tw->tw_now + ticks;
+		to.to_fired = false;
+		timerwheel_insert(tw, &to);
+		while (!to.to_fired) {
+			wchan_sleep(tw->tw_wchan, &tw->tw_lock);
+		}
+		spinlock_release(&tw->tw_lock);
+	}
+}
+
+void
+clocksleep_until(const struct timespec *when)
+{
+	clocksleep_common(when, false);
+}
+
+void
+clocksleep_exact(const struct timespec *when)
+{
+	clocksleep_common(when, true);
 }
 
 /*
@@ -112,10 +284,9 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
-	}
-	spinlock_release(&lbolt_lock);
+	struct timespec when;
+
+	gettime(&when);
+	when.tv_sec += num_secs;
+	clocksleep_until(&when);
 }
@@ -0,0 +1,317 @@
+/*
+ * Lock contention profiler. See lockprof.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <spl.h>
+#include <platform/maxcpus.h>
+#include <lockprof.h>
+
+#define LOCKPROF_SLOTS		512	/* per CPU; power of 2 */
+#define LOCKPROF_NAMELEN	16
+#define LOCKPROF_TOP		25	/* how many to print */
+
+struct lockprof_entry {
+	const void *le_obj;		/* NULL if slot unused */
+	const void *le_site;		/* first place it was acquired */
+	unsigned le_kind;
+	char le_name[LOCKPROF_NAMELEN];
+	unsigned long le_acquires;
+	unsigned long le_contended;
+	uint64_t le_waittotal;		/* ns */
+	uint64_t le_waitmax;		/* ns */
+	uint64_t le_holdtotal;		/* ns */
+};
+
+struct lockprof_table {
+	unsigned long lt_dropped;	/* events lost to a full table */
+	struct lockprof_entry lt_slots[LOCKPROF_SLOTS];
+};
+
+static struct lockprof_table *lockprof_tables[MAXCPUS];
+static volatile bool lockprof_running;
+
+static const char *const lockprof_kinds[] = { "spin", "lock", "wchan" };
+
+/*
+ * Allocate a table for each CPU and start profiling. Called from
+ * boot() once the clock and all the CPUs are up.
+ */
+void
+lockprof_bootstrap(void)
+{
+	unsigned i, n;
+
+	n = cpu_count();
+	KASSERT(n <= MAXCPUS);
+	for (i=0; i<n; i++) {
+		lockprof_tables[i] = kmalloc(sizeof(struct lockprof_table));
+		if (lockprof_tables[i] == NULL) {
+			panic("lockprof: Out of memory\n");
+		}
+		bzero(lockprof_tables[i], sizeof(struct lockprof_table));
+	}
+	lockprof_running = true;
+}
+
+uint64_t
+lockprof_now(void)
+{
+	struct timespec ts;
+
+	if (!lockprof_running) {
+		return 0;
+	}
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+unsigned
+lockprof_hash(const void *obj)
+{
+	/* Locks are at least word aligned; mix in the higher bits. */
+	uint32_t x = (uint32_t)(uintptr_t)obj >> 2;
+
+	return (x ^ (x >> 9)) & (LOCKPROF_SLOTS - 1);
+}
+
+/*
+ * Find OBJ's slot in TAB, or claim an empty one for it if CREATE.
+ * Returns NULL if it isn't there (or the table is full).
+ */
+static
+struct lockprof_entry *
+lockprof_find(struct lockprof_table *tab, const void *obj, bool create)
+{
+	struct lockprof_entry *le;
+	unsigned i, ix;
+
+	ix = lockprof_hash(obj);
+	for (i=0; i<LOCKPROF_SLOTS; i++) {
+		le = &tab->lt_slots[(ix + i) & (LOCKPROF_SLOTS - 1)];
+		if (le->le_obj == obj) {
+			return le;
+		}
+		if (le->le_obj == NULL) {
+			if (!create) {
+				return NULL;
+			}
+			le->le_obj = obj;
+			return le;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * This CPU's table, or NULL. Call with interrupts off.
+ */
+static
+struct lockprof_table *
+lockprof_mytable(void)
+{
+	if (!lockprof_running || !CURCPU_EXISTS()) {
+		return NULL;
+	}
+	return lockprof_tables[curcpu->c_number];
+}
+
+void
+lockprof_acquired(const void *obj, unsigned kind, const char *name,
+		  const void *site, uint64_t waitstart, uint64_t now)
+{
+	struct lockprof_table *tab;
+	struct lockprof_entry *le;
+	uint64_t wait;
+	int spl;
+
+	if (now == 0) {
+		return;
+	}
+
+	spl = splhigh();
+	tab = lockprof_mytable();
+	if (tab == NULL) {
+		splx(spl);
+		return;
+	}
+	le = lockprof_find(tab, obj, true);
+	if (le == NULL) {
+		tab->lt_dropped++;
+		splx(spl);
+		return;
+	}
+	if (le->le_acquires == 0) {
+		le->le_kind = kind;
+		le->le_site = site;
+		snprintf(le->le_name, sizeof(le->le_name), "%s",
+			 name != NULL ? name : "");
+	}
+	le->le_acquires++;
+	if (waitstart != 0) {
+		wait = now - waitstart;
+		le->le_contended++;
+		le->le_waittotal += wait;
+		if (wait > le->le_waitmax) {
+			le->le_waitmax = wait;
+		}
+	}
+	splx(spl);
+}
+
+void
+lockprof_released(const void *obj, uint64_t acqtime)
+{
+	struct lockprof_table *tab;
+	struct lockprof_entry *le;
+	uint64_t now;
+	int spl;
+
+	if (acqtime == 0) {
+		return;
+	}
+	now = lockprof_now();
+
+	spl = splhigh();
+	tab = lockprof_mytable();
+	if (tab != NULL) {
+		/*
+		 * Usually released on the CPU that acquired it; if not
+		 * (a sleep lock whose holder migrated) just add the
+		 * hold time here if we know the lock.
+		 */
+		le = lockprof_find(tab, obj, false);
+		if (le != NULL) {
+			le->le_holdtotal += now - acqtime;
+		}
+	}
+	splx(spl);
+}
+
+/*
+ * Add SRC's counts into the matching entry of the merged table MERGED
+ * (of NSLOTS slots, a power of 2).
+ */
+static
+void
+lockprof_merge(struct lockprof_entry *merged, unsigned nslots,
+	       const struct lockprof_entry *src)
+{
+	struct lockprof_entry *le;
+	uint32_t x = (uint32_t)(uintptr_t)src->le_obj >> 2;
+	unsigned i, ix;
+
+	ix = x ^ (x >> 9);
+	for (i=0; i<nslots; i++) {
+		le = &merged[(ix + i) & (nslots - 1)];
+		if (le->le_obj == NULL) {
+			*le = *src;
+			return;
+		}
+		if (le->le_obj == src->le_obj) {
+			le->le_acquires += src->le_acquires;
+			le->le_contended += src->le_contended;
+			le->le_waittotal += src->le_waittotal;
+			if (src->le_waitmax > le->le_waitmax) {
+				le->le_waitmax = src->le_waitmax;
+			}
+			le->le_holdtotal += src->le_holdtotal;
+			return;
+		}
+	}
+	/* Only if a flood of new locks turned up since we counted; skip. */
+}
+
+void
+lockprof_dump(bool clear)
+{
+	struct lockprof_entry *merged, *le, *best;
+	unsigned ncpus, nused, nslots, i, j;
+	unsigned long dropped = 0;
+
+	if (!lockprof_running) {
+		kprintf("Lock profiling has not started.\n");
+		return;
+	}
+
+	/*
+	 * Copy everything into one table first, so the printing
+	 * (which takes locks of its own) doesn't disturb the counts
+	 * we're looking at. The other CPUs go on updating theirs
+	 * while we read them, so the totals are a little fuzzy.
+	 */
+	ncpus = cpu_count();
+	nused = 0;
+	for (i=0; i<ncpus; i++) {
+		for (j=0; j<LOCKPROF_SLOTS; j++) {
+			if (lockprof_tables[i]->lt_slots[j].le_obj != NULL) {
+				nused++;
+			}
+		}
+	}
+	/* At most half full, and never full even if more turn up. */
+	nslots = 16;
+	while (nslots < 2 * nused) {
+		nslots *= 2;
+	}
+	merged = kmalloc(nslots * sizeof(*merged));
+	if (merged == NULL) {
+		kprintf("lockprof: Out of memory\n");
+		return;
+	}
+	bzero(merged, nslots * sizeof(*merged));
+
+	for (i=0; i<ncpus; i++) {
+		dropped += lockprof_tables[i]->lt_dropped;
+		for (j=0; j<LOCKPROF_SLOTS; j++) {
+			le = &lockprof_tables[i]->lt_slots[j];
+			if (le->le_obj != NULL && le->le_acquires > 0) {
+				lockprof_merge(merged, nslots, le);
+			}
+		}
+		if (clear) {
+			bzero(lockprof_tables[i],
+			      sizeof(struct lockprof_table));
+		}
+	}
+
+	kprintf("%-5s %-16s %-10s %-10s %9s %9s %11s %9s %11s\n",
+		"kind", "name", "address", "from", "acquires",
+		"contended", "wait(us)", "max(us)", "held(us)");
+	for (i=0; i<LOCKPROF_TOP; i++) {
+		/* Take the entry with the most wait that's left. */
+		best = NULL;
+		for (j=0; j<nslots; j++) {
+			le = &merged[j];
+			if (le->le_acquires == 0) {
+				continue;
+			}
+			if (best == NULL ||
+			    le->le_waittotal > best->le_waittotal) {
+				best = le;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		kprintf("%-5s %-16s %-10p %-10p %9lu %9lu %11llu %9llu "
+			"%11llu\n",
+			lockprof_kinds[best->le_kind], best->le_name,
+			best->le_obj, best->le_site,
+			best->le_acquires, best->le_contended,
+			(unsigned long long)(best->le_waittotal / 1000),
+			(unsigned long long)(best->le_waitmax / 1000),
+			(unsigned long long)(best->le_holdtotal / 1000));
+		best->le_acquires = 0;
+	}
+	if (dropped > 0) {
+		kprintf("(%lu events dropped: tables full)\n", dropped);
+	}
+
+	kfree(merged);
+}
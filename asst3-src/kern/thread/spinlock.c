@@ -50,7 +50,8 @@
 void
 spinlock_init(struct spinlock *splk)
 {
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_next, 0);
+	spinlock_data_set(&splk->splk_serving, 0);
 	splk->splk_holder = NULL;
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
 }
@@ -62,7 +63,8 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(spinlock_data_get(&splk->splk_next) ==
+		spinlock_data_get(&splk->splk_serving));
 }
 
 /*
@@ -70,12 +72,16 @@ spinlock_cleanup(struct spinlock *splk)
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
  * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * atomic operation to take a ticket, and wait for our turn.
  */
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+#if OPT_LOCKPROF
+	uint64_t waitstart = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -93,29 +99,32 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
-		}
-		break;
+	/*
+	 * The only atomic operation is taking the ticket. After that
+	 * we just read splk_serving, which changes only when the
+	 * holder lets go, so the waiting CPUs aren't all writing the
+	 * same word, and they get the lock first come, first served.
+	 */
+	ticket = spinlock_data_fetchinc(&splk->splk_next);
+#if OPT_LOCKPROF
+	if (spinlock_data_get(&splk->splk_serving) != ticket) {
+		waitstart = lockprof_now();
+	}
+#endif
+	while (spinlock_data_get(&splk->splk_serving) != ticket) {
+		/* spin */
 	}
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
 
+#if OPT_LOCKPROF
+	splk->splk_lptime = lockprof_now();
+	lockprof_acquired(splk, LOCKPROF_SPINLOCK, NULL,
+			  __builtin_return_address(0), waitstart,
+			  splk->splk_lptime);
+#endif
+
 	if (CURCPU_EXISTS()) {
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
@@ -135,9 +144,16 @@ spinlock_release(struct spinlock *splk)
 		HANGMAN_RELEASE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
 
+#if OPT_LOCKPROF
+	lockprof_released(splk, splk->splk_lptime);
+	splk->splk_lptime = 0;
+#endif
+
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	/* Only the holder writes this, so no atomic operation is needed. */
+	spinlock_data_set(&splk->splk_serving,
+			  spinlock_data_get(&splk->splk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
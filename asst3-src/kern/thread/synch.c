@@ -36,6 +36,7 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -138,6 +139,10 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/* All the locks there are, for lock_printstats. */
+static struct spinlock lock_listlock = SPINLOCK_INITIALIZER;
+static struct lock *lock_list;
+
 struct lock *
 lock_create(const char *name)
 {
@@ -165,6 +170,23 @@ lock_create(const char *name)
 	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
 
+	lock->lk_acquires = 0;
+	lock->lk_contended = 0;
+	lock->lk_spinwins = 0;
+	lock->lk_sleeps = 0;
+#if OPT_LOCKPROF
+	lock->lk_lptime = 0;
+#endif
+
+	spinlock_acquire(&lock_listlock);
+	lock->lk_prev = NULL;
+	lock->lk_next = lock_list;
+	if (lock_list != NULL) {
+		lock_list->lk_prev = lock;
+	}
+	lock_list = lock;
+	spinlock_release(&lock_listlock);
+
 	return lock;
 }
 
@@ -174,6 +196,19 @@ lock_destroy(struct lock *lock)
 	KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+
+	spinlock_acquire(&lock_listlock);
+	if (lock->lk_prev != NULL) {
+		lock->lk_prev->lk_next = lock->lk_next;
+	}
+	else {
+		lock_list = lock->lk_next;
+	}
+	if (lock->lk_next != NULL) {
+		lock->lk_next->lk_prev = lock->lk_prev;
+	}
+	spinlock_release(&lock_listlock);
+
 	spinlock_cleanup(&lock->lk_lock);
 	wchan_destroy(lock->lk_wchan);
 
@@ -181,9 +216,51 @@ lock_destroy(struct lock *lock)
 	kfree(lock);
 }
 
+/*
+ * How many times to check the lock while spinning before giving up
+ * and going to sleep.
+ */
+#define LOCK_SPINLIMIT	1000
+
+/*
+ * Spin (without lk_lock) until HOLDER, which was running on
+ * HOLDERCPU, no longer holds the lock or is no longer running, or
+ * until LOCK_SPINLIMIT checks have gone by. Only the lock and the cpu
+ * are looked at, since once it lets go of the lock the holder might
+ * exit and its thread structure vanish. Returns false if the limit was
+ * reached.
+ */
+static
+bool
+lock_spin(struct lock *lock, struct thread *holder, struct cpu *holdercpu)
+{
+	unsigned i;
+
+	for (i=0; i<LOCK_SPINLIMIT; i++) {
+		if (lock->lk_holder != holder ||
+		    *(struct thread *volatile *)&holdercpu->c_curthread
+		    != holder) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Get the lock. If the holder is running on another CPU, it will
+ * likely let go soon, so spin instead of paying for two context
+ * switches; otherwise sleep, as in the semaphore.
+ */
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	struct cpu *holdercpu;
+	bool contended, slept, changed;
+#if OPT_LOCKPROF
+	uint64_t waitstart = 0;
+#endif
+
 	DEBUGASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
 
@@ -193,12 +270,47 @@ lock_acquire(struct lock *lock)
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
 	KASSERT(lock->lk_holder != curthread);
-	while (lock->lk_holder != NULL) {
-		/* As in the semaphore. */
+	contended = slept = false;
+	while ((holder = lock->lk_holder) != NULL) {
+#if OPT_LOCKPROF
+		if (!contended) {
+			waitstart = lockprof_now();
+		}
+#endif
+		contended = true;
+
+		/* The holder can't go away while we hold lk_lock. */
+		holdercpu = holder->t_cpu;
+		if (holder->t_state == S_RUN &&
+		    holdercpu != curcpu->c_self) {
+			spinlock_release(&lock->lk_lock);
+			changed = lock_spin(lock, holder, holdercpu);
+			spinlock_acquire(&lock->lk_lock);
+			if (changed || lock->lk_holder != holder) {
+				continue;
+			}
+		}
+
+		slept = true;
+		lock->lk_sleeps++;
 		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
 	}
 	lock->lk_holder = curthread;
 
+	lock->lk_acquires++;
+	if (contended) {
+		lock->lk_contended++;
+		if (!slept) {
+			lock->lk_spinwins++;
+		}
+	}
+#if OPT_LOCKPROF
+	lock->lk_lptime = lockprof_now();
+	lockprof_acquired(lock, LOCKPROF_LOCK, lock->lk_name,
+			  __builtin_return_address(0), waitstart,
+			  lock->lk_lptime);
+#endif
+
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
 
@@ -213,6 +325,10 @@ lock_release(struct lock *lock)
 	spinlock_acquire(&lock->lk_lock);
 
 	KASSERT(lock->lk_holder == curthread);
+#if OPT_LOCKPROF
+	lockprof_released(lock, lock->lk_lptime);
+	lock->lk_lptime = 0;
+#endif
 	lock->lk_holder = NULL;
 	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
 
@@ -222,6 +338,34 @@ lock_release(struct lock *lock)
 	spinlock_release(&lock->lk_lock);
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+	bool ret;
+
+	DEBUGASSERT(lock != NULL);
+
+	spinlock_acquire(&lock->lk_lock);
+	KASSERT(lock->lk_holder != curthread);
+	ret = (lock->lk_holder == NULL);
+	if (ret) {
+		lock->lk_holder = curthread;
+		lock->lk_acquires++;
+#if OPT_LOCKPROF
+		lock->lk_lptime = lockprof_now();
+		lockprof_acquired(lock, LOCKPROF_LOCK, lock->lk_name,
+				  __builtin_return_address(0), 0,
+				  lock->lk_lptime);
+#endif
+		/* hangman insists on a wait before every acquire */
+		HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+		HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+	}
+	spinlock_release(&lock->lk_lock);
+
+	return ret;
+}
+
 bool
 lock_do_i_hold(struct lock *lock)
 {
@@ -236,6 +380,45 @@ lock_do_i_hold(struct lock *lock)
 	return ret;
 }
 
+/*
+ * Locks nobody ever waited for are left out; there are a great many
+ * of them (one per vnode, for a start). The list lock keeps locks
+ * from going away while we look, so the printing is done holding it;
+ * kprintf copes with that by going straight to the console.
+ */
+void
+lock_printstats(bool clear)
+{
+	struct lock *lock;
+	unsigned nlocks = 0, nshown = 0;
+
+	kprintf("%-20s %10s %10s %10s %10s\n", "name", "acquires",
+		"contended", "spinwins", "sleeps");
+
+	spinlock_acquire(&lock_listlock);
+	for (lock = lock_list; lock != NULL; lock = lock->lk_next) {
+		nlocks++;
+		if (lock->lk_contended > 0) {
+			nshown++;
+			kprintf("%-20s %10u %10u %10u %10u\n",
+				lock->lk_name, lock->lk_acquires,
+				lock->lk_contended, lock->lk_spinwins,
+				lock->lk_sleeps);
+		}
+		if (clear) {
+			spinlock_acquire(&lock->lk_lock);
+			lock->lk_acquires = 0;
+			lock->lk_contended = 0;
+			lock->lk_spinwins = 0;
+			lock->lk_sleeps = 0;
+			spinlock_release(&lock->lk_lock);
+		}
+	}
+	spinlock_release(&lock_listlock);
+
+	kprintf("%u of %u locks contended\n", nshown, nlocks);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
@@ -315,3 +498,231 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_rwchan = wchan_create(rw->rw_name);
+	if (rw->rw_rwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rw_wwchan = wchan_create(rw->rw_name);
+	if (rw->rw_wwchan == NULL) {
+		wchan_destroy(rw->rw_rwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writerswaiting = 0;
+	rw->rw_writer = NULL;
+	rw->rw_upgrader = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_writerswaiting == 0);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_wwchan);
+	wchan_destroy(rw->rw_rwchan);
+
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+/*
+ * A new reader may come in only if there is no writer and nobody is
+ * waiting to become one. Call with rw_lock held.
+ */
+static
+bool
+rwlock_readable(struct rwlock *rw)
+{
+	return rw->rw_writer == NULL && rw->rw_writerswaiting == 0 &&
+		rw->rw_upgrader == NULL;
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	while (!rwlock_readable(rw)) {
+		wchan_sleep(rw->rw_rwchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_readers == 1 && rw->rw_upgrader != NULL) {
+		/* Only the upgrader is left. */
+		wchan_wakethread(rw->rw_wwchan, rw->rw_upgrader, &rw->rw_lock);
+	}
+	else if (rw->rw_readers == 0 && rw->rw_writerswaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	/*
+	 * Count ourselves as waiting until we actually have the lock,
+	 * so readers stay out between our wakeup and our running.
+	 */
+	rw->rw_writerswaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_sleep(rw->rw_wwchan, &rw->rw_lock);
+	}
+	rw->rw_writerswaiting--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	if (rw->rw_writerswaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan, &rw->rw_lock);
+	}
+	else {
+		wchan_wakeall(rw->rw_rwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_tryacquire_read(struct rwlock *rw)
+{
+	bool ret;
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	ret = rwlock_readable(rw);
+	if (ret) {
+		rw->rw_readers++;
+	}
+	spinlock_release(&rw->rw_lock);
+
+	return ret;
+}
+
+bool
+rwlock_tryacquire_write(struct rwlock *rw)
+{
+	bool ret;
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	ret = (rw->rw_writer == NULL && rw->rw_readers == 0);
+	if (ret) {
+		rw->rw_writer = curthread;
+	}
+	spinlock_release(&rw->rw_lock);
+
+	return ret;
+}
+
+bool
+rwlock_upgrade(struct rwlock *rw)
+{
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	if (rw->rw_upgrader != NULL) {
+		KASSERT(rw->rw_upgrader != curthread);
+		spinlock_release(&rw->rw_lock);
+		return false;
+	}
+
+	/*
+	 * Setting rw_upgrader keeps new readers out; the last of the
+	 * others to leave wakes us. Waiting writers can't get in
+	 * ahead of us, since we still count as a reader.
+	 */
+	rw->rw_upgrader = curthread;
+	while (rw->rw_readers > 1) {
+		wchan_sleep(rw->rw_wwchan, &rw->rw_lock);
+	}
+	rw->rw_upgrader = NULL;
+	rw->rw_readers = 0;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+
+	return true;
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 1;
+	if (rw->rw_writerswaiting == 0) {
+		/* Let the other readers in with us. */
+		wchan_wakeall(rw->rw_rwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	bool ret;
+
+	spinlock_acquire(&rw->rw_lock);
+	ret = (rw->rw_writer == curthread);
+	spinlock_release(&rw->rw_lock);
+
+	return ret;
+}
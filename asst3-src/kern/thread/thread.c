@@ -49,6 +49,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
@@ -58,12 +59,42 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
-/* Wait channel. A wchan is protected by an associated, passed-in spinlock. */
+/*
+ * Wait channel. A wchan is protected by an associated, passed-in
+ * spinlock.
+ *
+ * The sleeping threads aren't kept in the wchan itself: all wchans
+ * share a fixed table of sleep queues, and a thread sleeps on the
+ * queue its wchan's address hashes to, with t_wchan saying which
+ * wchan it's waiting for. So a wchan that nobody ever sleeps on costs
+ * only its name. Each sleep queue has a spinlock of its own, since
+ * wchans with different associated spinlocks can share a queue; it
+ * comes after the wchan's spinlock and the runqueue locks in the lock
+ * order, and nothing else is locked while holding it.
+ *
+ * Each wchan counts its sleepers, under its sleep queue's lock, so
+ * that looking for them can stop as soon as they've all been found
+ * (or straight away if there are none) instead of walking past every
+ * other wchan's threads in the queue.
+ */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
-	struct threadlist wc_threads;	/* list of waiting threads */
+	unsigned wc_sleepers;		/* threads in the queue for it */
+};
+
+#define SLEEPQ_SIZE	64		/* number of sleep queues; power of 2 */
+
+struct sleepq {
+	struct spinlock sq_lock;
+	struct threadlist sq_threads;	/* threads sleeping, on any wchan */
 };
 
+static struct sleepq sleepqs[SLEEPQ_SIZE];
+
+/* Wait channels. (Usable before thread_bootstrap.) */
+static struct kmem_cache wchan_cache =
+	KMEM_CACHE_INITIALIZER("wchan", struct wchan, NULL, NULL);
+
 /* Master array of CPUs. */
 DECLARRAY(cpu, static __UNUSED inline);
 DEFARRAY(cpu, static __UNUSED inline);
@@ -72,6 +103,16 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Dead threads each CPU keeps, stack and all, for thread_fork to
+ * reuse. Each one costs a page of stack.
+ */
+#define THREAD_POOLMAX	16
+
+/* Thread structures. (Usable before thread_bootstrap.) */
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", struct thread, NULL, NULL);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -112,38 +153,33 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Set up a new thread, or one taken back out of the pool, as if
+ * freshly created. Leaves t_stack alone.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_init(struct thread *thread, const char *name)
 {
-	struct thread *thread;
-
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
-	}
-
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+		return ENOMEM;
 	}
 	thread->t_wchan_name = "NEW";
+	thread->t_wchan = NULL;
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_lastran = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -152,6 +188,29 @@ thread_create(const char *name)
 
 	/* If you add to struct thread, be sure to initialize here */
 
+	return 0;
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	thread = kmem_cache_alloc(&thread_cache);
+	if (thread == NULL) {
+		return NULL;
+	}
+	thread->t_stack = NULL;
+
+	if (thread_init(thread, name)) {
+		kmem_cache_free(&thread_cache, thread);
+		return NULL;
+	}
 	return thread;
 }
 
@@ -169,6 +228,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -180,15 +240,22 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadpool);
+	spinlock_init(&c->c_threadpool_lock);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_posted = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -287,12 +354,98 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(&thread_cache, thread);
+}
+
+/*
+ * Put a dead thread in this cpu's pool so thread_fork can have it
+ * back without allocating (and marking) a new stack. Returns false,
+ * leaving the thread alone, if it can't be kept: the pool is full,
+ * or it's running on the boot stack.
+ *
+ * Pooled threads have no name and are otherwise as they were when
+ * they died; thread_init sets them up again.
+ */
+static
+bool
+thread_pool_put(struct thread *thread)
+{
+	struct cpu *c = curcpu->c_self;
+	char *name;
+
+	KASSERT(thread->t_proc == NULL);
+	if (thread->t_stack == NULL) {
+		return false;
+	}
+	thread_checkstack(thread);
+	thread_machdep_cleanup(&thread->t_machdep);
+
+	spinlock_acquire(&c->c_threadpool_lock);
+	if (c->c_threadpool.tl_count >= THREAD_POOLMAX) {
+		spinlock_release(&c->c_threadpool_lock);
+		return false;
+	}
+	name = thread->t_name;
+	thread->t_name = NULL;
+	thread->t_wchan_name = "POOLED";
+	threadlist_addhead(&c->c_threadpool, thread);
+	spinlock_release(&c->c_threadpool_lock);
+
+	kfree(name);
+	return true;
+}
+
+/*
+ * Take a thread out of this cpu's pool, or return NULL if it's empty.
+ * The most recently pooled comes first, as its stack is likeliest to
+ * still be in the cache.
+ */
+static
+struct thread *
+thread_pool_get(void)
+{
+	struct cpu *c = curcpu->c_self;
+	struct thread *thread;
+
+	spinlock_acquire(&c->c_threadpool_lock);
+	thread = threadlist_remhead(&c->c_threadpool);
+	spinlock_release(&c->c_threadpool_lock);
+
+	return thread;
+}
+
+/*
+ * Free every pooled thread on every cpu. Called by alloc_kpages when
+ * memory runs out. Returns the number of threads (and so pages of
+ * stack) freed.
+ */
+unsigned
+thread_pool_reclaim(void)
+{
+	struct cpu *c;
+	struct thread *t;
+	unsigned i, n = 0;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		while (1) {
+			spinlock_acquire(&c->c_threadpool_lock);
+			t = threadlist_remhead(&c->c_threadpool);
+			spinlock_release(&c->c_threadpool_lock);
+			if (t == NULL) {
+				break;
+			}
+			thread_destroy(t);
+			n++;
+		}
+	}
+	return n;
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Those we can, we keep
+ * for reuse instead.
  *
  * The list of zombies is per-cpu.
  */
@@ -305,7 +458,9 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (!thread_pool_put(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -317,6 +472,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *rq;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -331,9 +489,13 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		rq = &curcpu->c_runqueue[i];
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -374,8 +536,15 @@ thread_shutdown(void)
 void
 thread_bootstrap(void)
 {
+	unsigned i;
+
 	cpuarray_init(&allcpus);
 
+	for (i=0; i<SLEEPQ_SIZE; i++) {
+		spinlock_init(&sleepqs[i].sq_lock);
+		threadlist_init(&sleepqs[i].sq_threads);
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -445,6 +614,168 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Run queue operations. Each CPU has one list per priority level;
+ * threads are taken from the highest-priority nonempty one. Call
+ * these with the CPU's runqueue lock held.
+ */
+
+/* Number of threads on C's run queue. */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	return c->c_runcount;
+}
+
+/* True if something on C's run queue is more important than LEVEL. */
+static
+bool
+runqueue_hasabove(struct cpu *c, unsigned level)
+{
+	unsigned i;
+
+	for (i=0; i<level; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Queue T at the back of its level. */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runcount++;
+}
+
+/* Take the next thread to run, or NULL. */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Time in hardclocks, as counted by the boot CPU. Only good for
+ * comparing how long ago threads last ran.
+ */
+static
+unsigned
+thread_now(void)
+{
+	return cpuarray_get(&allcpus, 0)->c_hardclocks;
+}
+
+/*
+ * Work stealing. Called by a CPU that has nothing to run, with
+ * interrupts off and no runqueue lock held.
+ *
+ * Pick the CPU with the most queued threads, going by an unlocked
+ * look at the c_runcounts, and move the thread on its run queue that
+ * has been off CPU longest (its cache footprint is the most likely to
+ * be gone already) to our own run queue. The candidates are the heads
+ * of the victim's per-level lists, since each list is in FIFO order.
+ * Returns true if we got one.
+ *
+ * Only one runqueue lock is held at a time, so two CPUs stealing
+ * from each other can't deadlock.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t, *best;
+	unsigned i, numcpus, load, bestload, level, bestlevel;
+
+	victim = NULL;
+	bestload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		load = c->c_runcount;
+		if (c->c_isidle && load > 0) {
+			/* it is about to run one of them itself */
+			load--;
+		}
+		if (load > bestload) {
+			bestload = load;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	best = NULL;
+	bestlevel = 0;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	for (level=0; level<SCHED_NLEVELS; level++) {
+		THREADLIST_FORALL(t, victim->c_runqueue[level]) {
+			/*
+			 * The victim's current thread can be on its
+			 * run queue if it went to sleep, the victim
+			 * went idle, and then the thread was woken
+			 * (see thread_switch). It's still running on
+			 * its own stack, so it can't be moved.
+			 */
+			if (t != victim->c_curthread && t != curthread) {
+				break;
+			}
+		}
+		if (t == NULL) {
+			continue;
+		}
+		if (best == NULL || (int)(t->t_lastran - best->t_lastran) < 0) {
+			best = t;
+			bestlevel = level;
+		}
+	}
+	if (best != NULL) {
+		threadlist_remove(&victim->c_runqueue[bestlevel], best);
+		victim->c_runcount--;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (best == NULL) {
+		return false;
+	}
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+	      best->t_name, victim->c_number, curcpu->c_number);
+
+	best->t_cpu = curcpu->c_self;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	runqueue_add(curcpu, best);
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return true;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -469,7 +800,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -503,18 +834,29 @@ thread_fork(const char *name,
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
-	if (newthread == NULL) {
-		return ENOMEM;
+	/* Reuse a dead thread and its stack if we have one */
+	newthread = thread_pool_get();
+	if (newthread != NULL) {
+		result = thread_init(newthread, name);
+		if (result) {
+			thread_destroy(newthread);
+			return result;
+		}
 	}
+	else {
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -522,6 +864,7 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_priority = curthread->t_priority;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -550,6 +893,39 @@ thread_fork(const char *name,
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Sleep queues
+
+/*
+ * The sleep queue for WC. wchans come from wchan_cache, so the low
+ * three bits of the address are always zero.
+ */
+static
+struct sleepq *
+wchan_sleepq(struct wchan *wc)
+{
+	uint32_t x = (uint32_t)(uintptr_t)wc >> 3;
+
+	return &sleepqs[(x ^ (x >> 6)) & (SLEEPQ_SIZE - 1)];
+}
+
+/*
+ * Put T at the back of WC's sleep queue.
+ */
+static
+void
+wchan_enqueue(struct wchan *wc, struct thread *t)
+{
+	struct sleepq *sq = wchan_sleepq(wc);
+
+	spinlock_acquire(&sq->sq_lock);
+	t->t_wchan = wc;
+	wc->wc_sleepers++;
+	threadlist_addtail(&sq->sq_threads, t);
+	spinlock_release(&sq->sq_lock);
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -591,7 +967,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && runqueue_count(curcpu) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -607,14 +983,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
 		/*
-		 * Add the thread to the list in the wait channel, and
-		 * unlock same. To avoid a race with someone else
-		 * calling wchan_wake*, we must keep the wchan's
+		 * Add the thread to the wait channel's sleep queue,
+		 * and unlock the wchan. To avoid a race with someone
+		 * else calling wchan_wake*, we must keep the wchan's
 		 * associated spinlock locked from the point the
 		 * caller of wchan_sleep locked it until the thread is
-		 * on the list.
+		 * on the queue.
 		 */
-		threadlist_addtail(&wc->wc_threads, cur);
+		wchan_enqueue(wc, cur);
 		spinlock_release(lk);
 		break;
 	    case S_ZOMBIE:
@@ -623,10 +999,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		break;
 	}
 	cur->t_state = newstate;
+	cur->t_lastran = thread_now();
 
 	/*
-	 * Get the next thread. While there isn't one, call cpu_idle().
-	 * curcpu->c_isidle must be true when cpu_idle is
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and if that fails call cpu_idle(). Since
+	 * every interrupt (including each hardclock) brings us back
+	 * here, an idle cpu looks for work to steal at least once a
+	 * tick. curcpu->c_isidle must be true when cpu_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
 	 *
@@ -644,10 +1024,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -821,139 +1203,95 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each CPU has SCHED_NLEVELS
+ * run queues, and always runs the first thread of the highest-priority
+ * (lowest-numbered) nonempty one. A thread at level L gets a time
+ * slice of SCHED_QUANTUM(L) hardclocks; if it uses it all up it drops
+ * a level, so CPU-bound threads sink and get longer but rarer slices.
+ * A thread woken from a wait channel rises a level, so threads that
+ * mostly wait (the shell, anything doing I/O) stay near the top and
+ * run soon after they are woken. A thread that is running is switched
+ * out at the next clock tick if a higher-priority one is ready.
+ *
+ * To keep sunk threads from starving, schedule() periodically puts
+ * everything on this CPU back at the top.
  */
 
+#define SCHED_QUANTUM(level)	(1U << (level))
+
+/*
+ * Called periodically from hardclock(). Reset every thread on this
+ * CPU's run queue, and the current thread, to the top level.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t;
+	unsigned i;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i])) != NULL) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Called every hardclock(). Charge the tick to the current thread; if
+ * that ends its time slice, demote it and yield. Otherwise yield only
+ * if a higher-priority thread has become ready.
  */
 void
-thread_consider_migration(void)
+thread_timeslice(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct thread *cur;
+	bool preempt;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* thread_switch would do nothing anyway */
+		return;
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	cur = curthread;
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		thread_yield();
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
+	preempt = runqueue_hasabove(curcpu, cur->t_priority);
 	spinlock_release(&curcpu->c_runqueue_lock);
-
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
-		}
-		spinlock_release(&c->c_runqueue_lock);
+	if (preempt) {
+		thread_yield();
 	}
+}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+/*
+ * Give a thread that is being woken up a priority boost, and a fresh
+ * time slice. The thread is not on any run queue, so this needs no
+ * lock.
+ */
+static
+void
+thread_wakeboost(struct thread *t)
+{
+	if (t->t_priority > 0) {
+		t->t_priority--;
 	}
-
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	t->t_ticks = 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -962,6 +1300,70 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Take threads sleeping on WC off its sleep queue and put them on
+ * LIST, longest sleeping first: all of them if ALL is set, otherwise
+ * only the first. Returns the number moved.
+ *
+ * The threads are made runnable afterwards, by the caller, so that
+ * the sleep queue lock is never held while taking a runqueue lock.
+ */
+static
+unsigned
+wchan_dequeue(struct wchan *wc, bool all, struct threadlist *list)
+{
+	struct sleepq *sq = wchan_sleepq(wc);
+	struct thread *t, *next;
+	unsigned n = 0;
+
+	spinlock_acquire(&sq->sq_lock);
+	for (t = sq->sq_threads.tl_head.tln_next->tln_self;
+	     t != NULL && wc->wc_sleepers > 0; t = next) {
+		next = t->t_listnode.tln_next->tln_self;
+		if (t->t_wchan != wc) {
+			continue;
+		}
+		threadlist_remove(&sq->sq_threads, t);
+		t->t_wchan = NULL;
+		wc->wc_sleepers--;
+		threadlist_addtail(list, t);
+		n++;
+		if (!all) {
+			break;
+		}
+	}
+	spinlock_release(&sq->sq_lock);
+
+	return n;
+}
+
+/*
+ * Make runnable all the threads on LIST, which wchan_dequeue filled.
+ */
+static
+void
+wchan_wakelist(struct threadlist *list)
+{
+	struct thread *target;
+
+	/*
+	 * We could conceivably sort by cpu first to cause fewer lock
+	 * ops and fewer IPIs, but for now at least don't bother. Just
+	 * make each thread runnable.
+	 *
+	 * Note that thread_make_runnable acquires a runqueue lock
+	 * while we're holding the wchan's spinlock. This is ok; all
+	 * spinlocks associated with wchans must come before the
+	 * runqueue locks, as we also bridge from the wchan lock to
+	 * the runqueue lock in thread_switch.
+	 */
+	while ((target = threadlist_remhead(list)) != NULL) {
+		thread_wakeboost(target);
+		thread_make_runnable(target, false);
+	}
+	threadlist_cleanup(list);
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -975,16 +1377,34 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
+	wc->wc_sleepers = 0;
 
 	return wc;
 }
 
+/*
+ * Return true if anything is sleeping on WC. Needs the sleep queue
+ * lock, not the wchan's.
+ */
+static
+bool
+wchan_hassleepers(struct wchan *wc)
+{
+	struct sleepq *sq = wchan_sleepq(wc);
+	bool ret;
+
+	spinlock_acquire(&sq->sq_lock);
+	ret = wc->wc_sleepers > 0;
+	spinlock_release(&sq->sq_lock);
+
+	return ret;
+}
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  * (The corresponding cleanup functions require this.)
@@ -992,8 +1412,8 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(!wchan_hassleepers(wc));
+	kmem_cache_free(&wchan_cache, wc);
 }
 
 /*
@@ -1006,6 +1426,10 @@ wchan_destroy(struct wchan *wc)
 void
 wchan_sleep(struct wchan *wc, struct spinlock *lk)
 {
+#if OPT_LOCKPROF
+	uint64_t waitstart;
+#endif
+
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
 
@@ -1015,8 +1439,16 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	/* must not hold other spinlocks */
 	KASSERT(curcpu->c_spinlocks == 1);
 
+#if OPT_LOCKPROF
+	waitstart = lockprof_now();
+#endif
 	thread_switch(S_SLEEP, wc, lk);
 	spinlock_acquire(lk);
+#if OPT_LOCKPROF
+	lockprof_acquired(wc, LOCKPROF_WCHAN, wc->wc_name,
+			  __builtin_return_address(0), waitstart,
+			  lockprof_now());
+#endif
 }
 
 /*
@@ -1025,27 +1457,13 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 void
 wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 {
-	struct thread *target;
+	struct threadlist list;
 
 	KASSERT(spinlock_do_i_hold(lk));
 
-	/* Grab a thread from the channel */
-	target = threadlist_remhead(&wc->wc_threads);
-
-	if (target == NULL) {
-		/* Nobody was sleeping. */
-		return;
-	}
-
-	/*
-	 * Note that thread_make_runnable acquires a runqueue lock
-	 * while we're holding LK. This is ok; all spinlocks
-	 * associated with wchans must come before the runqueue locks,
-	 * as we also bridge from the wchan lock to the runqueue lock
-	 * in thread_switch.
-	 */
-
-	thread_make_runnable(target, false);
+	threadlist_init(&list);
+	wchan_dequeue(wc, false, &list);
+	wchan_wakelist(&list);
 }
 
 /*
@@ -1054,31 +1472,38 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 void
 wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 {
-	struct thread *target;
 	struct threadlist list;
 
 	KASSERT(spinlock_do_i_hold(lk));
 
 	threadlist_init(&list);
+	wchan_dequeue(wc, true, &list);
+	wchan_wakelist(&list);
+}
 
-	/*
-	 * Grab all the threads from the channel, moving them to a
-	 * private list.
-	 */
-	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
-		threadlist_addtail(&list, target);
-	}
+/*
+ * Wake up one particular thread sleeping on a wait channel. The
+ * thread knows where it is in the queue, so there's no searching;
+ * the timer wheels call this from the clock interrupt for every
+ * expired sleep.
+ */
+void
+wchan_wakethread(struct wchan *wc, struct thread *t, struct spinlock *lk)
+{
+	struct sleepq *sq = wchan_sleepq(wc);
 
-	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
-	 */
-	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
-	}
+	KASSERT(spinlock_do_i_hold(lk));
+
+	spinlock_acquire(&sq->sq_lock);
+	KASSERT(t->t_wchan == wc);
+	threadlist_remove(&sq->sq_threads, t);
+	t->t_wchan = NULL;
+	KASSERT(wc->wc_sleepers > 0);
+	wc->wc_sleepers--;
+	spinlock_release(&sq->sq_lock);
 
-	threadlist_cleanup(&list);
+	thread_wakeboost(t);
+	thread_make_runnable(t, false);
 }
 
 /*
@@ -1088,12 +1513,8 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 bool
 wchan_isempty(struct wchan *wc, struct spinlock *lk)
 {
-	bool ret;
-
 	KASSERT(spinlock_do_i_hold(lk));
-	ret = threadlist_isempty(&wc->wc_threads);
-
-	return ret;
+	return !wchan_hassleepers(wc);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1134,37 +1555,122 @@ ipi_broadcast(int code)
 }
 
 /*
- * Send a TLB shootdown IPI to the specified CPU.
+ * Send a TLB shootdown IPI to the specified CPU. Returns a ticket for
+ * ipi_tlbshootdown_wait.
+ *
+ * Each request can carry several pages (see struct tlbshootdown), and
+ * if the target already has shootdowns pending they are all handled
+ * on the one interrupt, so no new IPI is sent.
  */
-void
+unsigned
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	unsigned n;
+	unsigned n, ticket;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n >= TLBSHOOTDOWN_MAX) {
 		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
+		 * The queue is full. Rather than wait for space
+		 * (which we can't do here), coalesce: the target will
+		 * flush its whole TLB, which covers every request.
 		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
+		target->c_numshootdown = TLBSHOOTDOWN_MAX + 1;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+	ticket = ++target->c_shootdown_posted;
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	if ((target->c_ipi_pending & ((uint32_t)1 << IPI_TLBSHOOTDOWN)) == 0) {
+		target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(target);
+	}
 
 	spinlock_release(&target->c_ipi_lock);
+	return ticket;
+}
+
+/*
+ * Carry out all the shootdowns queued for the current CPU. Call with
+ * its IPI lock held.
+ */
+static
+void
+ipi_tlbshootdown_run(void)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_ipi_lock));
+
+	if (curcpu->c_numshootdown > TLBSHOOTDOWN_MAX) {
+		vm_tlbshootdown(NULL);
+	}
+	else {
+		for (i=0; i<curcpu->c_numshootdown; i++) {
+			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+		}
+	}
+	curcpu->c_numshootdown = 0;
+	curcpu->c_shootdown_done = curcpu->c_shootdown_posted;
+	curcpu->c_ipi_pending &= ~((uint32_t)1 << IPI_TLBSHOOTDOWN);
+}
+
+/*
+ * Wait for TARGET to carry out the shootdown with ticket TICKET.
+ *
+ * The target may itself be waiting, with interrupts off, for a
+ * shootdown it sent us; so while we wait we do our own queued
+ * shootdowns by hand instead of relying on the interrupt.
+ */
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	KASSERT(target != curcpu->c_self);
+
+	/* Tickets wrap; compare by difference. */
+	while ((int)(target->c_shootdown_done - ticket) < 0) {
+		if (*(volatile unsigned *)&curcpu->c_numshootdown > 0) {
+			spinlock_acquire(&curcpu->c_ipi_lock);
+			ipi_tlbshootdown_run();
+			spinlock_release(&curcpu->c_ipi_lock);
+		}
+	}
+}
+
+/*
+ * Send MAPPING to each CPU in the bitmask CPUS other than this one,
+ * then wait for them all: the IPIs are all sent before we wait on
+ * the first, so the targets work in parallel.
+ */
+void
+ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mapping)
+{
+	unsigned tickets[32];
+	unsigned i, num;
+	struct cpu *c;
+
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	num = cpuarray_num(&allcpus);
+	KASSERT(num <= 32);
+
+	cpus &= ~((uint32_t)1 << curcpu->c_number);
+	for (i=0; i<num; i++) {
+		if (cpus & ((uint32_t)1 << i)) {
+			c = cpuarray_get(&allcpus, i);
+			tickets[i] = ipi_tlbshootdown(c, mapping);
+		}
+	}
+	for (i=0; i<num; i++) {
+		if (cpus & ((uint32_t)1 << i)) {
+			c = cpuarray_get(&allcpus, i);
+			ipi_tlbshootdown_wait(c, tickets[i]);
+		}
+	}
 }
 
 /*
@@ -1174,7 +1680,6 @@ void
 interprocessor_interrupt(void)
 {
 	uint32_t bits;
-	unsigned i;
 
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
@@ -1204,14 +1709,10 @@ interprocessor_interrupt(void)
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		/*
-		 * Note: depending on your VM system locking you might
-		 * need to release the ipi lock while calling
-		 * vm_tlbshootdown.
+		 * vm_tlbshootdown takes no locks, so it's fine to
+		 * call it with the ipi lock held.
 		 */
-		for (i=0; i<curcpu->c_numshootdown; i++) {
-			vm_tlbshootdown(&curcpu->c_shootdown[i]);
-		}
-		curcpu->c_numshootdown = 0;
+		ipi_tlbshootdown_run();
 	}
 
 	curcpu->c_ipi_pending = 0;
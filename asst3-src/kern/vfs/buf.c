@@ -0,0 +1,1076 @@
+/*
+ * Block buffer cache. See buf.h for the interface.
+ *
+ * All the buffers are made at boot, enough to take up 1/BUF_RAMFRACTION
+ * of the free memory. Each buffer is either attached to a block, in
+ * which case it is on a hash chain keyed by (fs, block), or not.
+ *
+ * buf_spinlock protects the hash chains, the LRU list, and each
+ * buffer's identity (b_fs, b_block) and b_refcount. b_refcount counts
+ * the threads that hold the buffer or are waiting for its lock;
+ * buffers with no references are on the LRU list, least recently used
+ * at the head. The data and the valid and dirty flags belong to
+ * whoever holds b_lock, except that while a buffer is unreferenced
+ * nobody holds b_lock and they may be looked at under buf_spinlock.
+ *
+ * A buffer is only given a new identity while the thread doing so
+ * has the only reference, so holding a reference keeps a buffer
+ * attached to its block.
+ *
+ * Read-ahead requests go on a queue, also under buf_spinlock, and
+ * BUF_RATHREADS read-ahead threads read them into the cache. Each
+ * takes the request at the head of the queue along with any that
+ * follow it for the next blocks on the disk, up to BUF_RARUN in all,
+ * and reads them with one fsop_readblock; with several threads at it
+ * several reads are in flight at once, which gives the disk's I/O
+ * scheduler something to work with. A read-ahead thread only ever
+ * takes buffers that are free and uncached, and never waits for one,
+ * so holding a run of them can't deadlock. The threads take no file
+ * system locks, so the fsop_readblock and fsop_writeblock functions
+ * mustn't need any.
+ *
+ * Dirty buffers are written back by the flusher thread, which looks
+ * them over every BUF_FLUSHWAKE ms: it writes those that have been
+ * dirty for BUF_MAXAGE ms, and if more than 1/BUF_DIRTYHI of the
+ * buffers are dirty it writes them regardless of age until no more
+ * than 1/BUF_DIRTYLO are. A buffer goes out together with any
+ * unheld dirty buffers for the blocks next to it, in one write of up
+ * to BUF_FLUSHRUN blocks. The flusher never waits for a b_lock (the
+ * holder may be waiting for something the flusher has); it skips
+ * buffers it can't have at once and gets them next time.
+ *
+ * buf_ndirty counts the dirty buffers. It changes along with
+ * b_dirty, which is only ever changed holding both b_lock and
+ * buf_spinlock.
+ *
+ * Lock order: file system locks (vfs_biglock), then b_lock, then
+ * buf_spinlock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <clock.h>
+#include <vm.h>
+#include <fs.h>
+#include <buf.h>
+#include "opt-dumbvm.h"
+
+#define BUF_RAMFRACTION	16	/* use 1/16 of free memory */
+#define BUF_MINBUFS	64
+#define BUF_MAXBUFS	4096
+#define BUF_PERPAGE	(PAGE_SIZE / BUF_SIZE)
+#define BUF_RAQUEUE	64	/* read-ahead requests waiting */
+#define BUF_RATHREADS	4	/* read-ahead threads */
+#define BUF_RARUN	8	/* most blocks read ahead at once */
+#define BUF_FLUSHWAKE	100	/* ms between flusher passes */
+#define BUF_MAXAGE	5000	/* ms a buffer may stay dirty */
+#define BUF_DIRTYHI	4	/* flush regardless above 1/4 dirty... */
+#define BUF_DIRTYLO	8	/* ...down to 1/8 */
+#define BUF_FLUSHRUN	16	/* most blocks written at once */
+
+struct buf {
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lrunext;		/* LRU list, if unreferenced */
+	struct buf *b_lruprev;
+	struct fs *b_fs;		/* NULL if not attached */
+	daddr_t b_block;
+	unsigned b_refcount;
+	bool b_valid;			/* data is the block's contents */
+	bool b_dirty;			/* data is newer than the disk */
+	bool b_readahead;		/* read ahead and not yet asked for */
+	uint32_t b_dirtysince;		/* buf_now() when it became dirty */
+	struct lock *b_lock;
+	void *b_data;
+};
+
+struct bufstats {
+	unsigned long bs_reads;		/* buffer_read calls */
+	unsigned long bs_hits;		/* ... found valid in the cache */
+	unsigned long bs_devreads;	/* blocks read from disk */
+	unsigned long bs_devwrites;	/* blocks written to disk */
+	unsigned long bs_reuses;	/* buffers taken for another block */
+	unsigned long bs_dirtyreuses;	/* ... that had to be written first */
+	unsigned long bs_waits;		/* times all buffers were held */
+	unsigned long bs_raqueued;	/* read-ahead requests queued */
+	unsigned long bs_radropped;	/* ... not, as the queue was full */
+	unsigned long bs_raruns;	/* reads done for read-ahead */
+	unsigned long bs_radone;	/* ... and blocks in them */
+	unsigned long bs_rahits;	/* ... and then read */
+	unsigned long bs_flushruns;	/* writes done by the flusher */
+	unsigned long bs_flushblocks;	/* ... and blocks in them */
+};
+
+struct rareq {
+	struct fs *rr_fs;
+	daddr_t rr_block;
+};
+
+static struct spinlock buf_spinlock = SPINLOCK_INITIALIZER;
+static struct wchan *buf_wchan;		/* waiting for an unheld buffer */
+static struct buf *bufs;
+static unsigned nbufs;
+static struct buf **buf_hash;
+static unsigned buf_hashsize;		/* power of 2 */
+static struct buf buf_lru;		/* list head; never a real buffer */
+static struct bufstats buf_stats;
+
+/* Read-ahead queue, also under buf_spinlock. */
+static struct rareq ra_queue[BUF_RAQUEUE];
+static unsigned ra_head, ra_count;
+static struct fs *ra_busyfs[BUF_RATHREADS]; /* fs each is reading for */
+static struct wchan *ra_wchan;		/* read-ahead thread waits here */
+static struct wchan *ra_donewchan;	/* buffer_drop_fs waits here */
+static char *ra_data[BUF_RATHREADS];	/* each thread's BUF_RARUN blocks */
+
+/* Flusher state, also under buf_spinlock. */
+static unsigned buf_ndirty;
+static struct fs *fl_busyfs;		/* fs being written for, or NULL */
+static struct wchan *fl_wchan;		/* flusher waits here for work */
+static struct wchan *fl_donewchan;	/* buffer_drop_fs waits here */
+static char *fl_data;			/* flusher's BUF_FLUSHRUN blocks */
+
+static void buf_rathread(void *, unsigned long);
+static void buf_flushthread(void *, unsigned long);
+
+/*
+ * Make all the buffers.
+ */
+void
+buffer_bootstrap(void)
+{
+	struct buf *b;
+	char *page = NULL;
+	unsigned i;
+	int result;
+
+#if OPT_DUMBVM
+	/* dumbvm never gets memory back; keep the cache small. */
+	nbufs = BUF_MINBUFS;
+#else
+	nbufs = frame_freecount() * BUF_PERPAGE / BUF_RAMFRACTION;
+#endif
+	if (nbufs < BUF_MINBUFS) {
+		nbufs = BUF_MINBUFS;
+	}
+	if (nbufs > BUF_MAXBUFS) {
+		nbufs = BUF_MAXBUFS;
+	}
+	nbufs = ROUNDUP(nbufs, BUF_PERPAGE);
+
+	buf_hashsize = 1;
+	while (buf_hashsize < nbufs) {
+		buf_hashsize *= 2;
+	}
+
+	bufs = kmalloc(nbufs * sizeof(struct buf));
+	buf_hash = kmalloc(buf_hashsize * sizeof(struct buf *));
+	buf_wchan = wchan_create("buffers");
+	ra_wchan = wchan_create("readahead");
+	ra_donewchan = wchan_create("readahead done");
+	fl_wchan = wchan_create("flusher");
+	fl_donewchan = wchan_create("flusher done");
+	fl_data = kmalloc(BUF_FLUSHRUN * BUF_SIZE);
+	for (i=0; i<BUF_RATHREADS; i++) {
+		ra_data[i] = kmalloc(BUF_RARUN * BUF_SIZE);
+		if (ra_data[i] == NULL) {
+			panic("buffer_bootstrap: Out of memory\n");
+		}
+	}
+	if (bufs == NULL || buf_hash == NULL || buf_wchan == NULL ||
+	    ra_wchan == NULL || ra_donewchan == NULL || fl_wchan == NULL ||
+	    fl_donewchan == NULL || fl_data == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	for (i=0; i<buf_hashsize; i++) {
+		buf_hash[i] = NULL;
+	}
+
+	buf_lru.b_lrunext = buf_lru.b_lruprev = &buf_lru;
+	for (i=0; i<nbufs; i++) {
+		b = &bufs[i];
+		if (i % BUF_PERPAGE == 0) {
+			page = kmalloc(PAGE_SIZE);
+			if (page == NULL) {
+				panic("buffer_bootstrap: Out of memory\n");
+			}
+		}
+		b->b_data = page + (i % BUF_PERPAGE) * BUF_SIZE;
+		b->b_lock = lock_create("buf");
+		if (b->b_lock == NULL) {
+			panic("buffer_bootstrap: Out of memory\n");
+		}
+		b->b_hashnext = NULL;
+		b->b_fs = NULL;
+		b->b_block = 0;
+		b->b_refcount = 0;
+		b->b_valid = false;
+		b->b_dirty = false;
+		b->b_readahead = false;
+		b->b_dirtysince = 0;
+
+		/* Put it on the LRU list */
+		b->b_lrunext = &buf_lru;
+		b->b_lruprev = buf_lru.b_lruprev;
+		buf_lru.b_lruprev->b_lrunext = b;
+		buf_lru.b_lruprev = b;
+	}
+
+	for (i=0; i<BUF_RATHREADS; i++) {
+		result = thread_fork("readahead", NULL, buf_rathread, NULL, i);
+		if (result) {
+			panic("buffer_bootstrap: thread_fork: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork("flusher", NULL, buf_flushthread, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+
+	kprintf("buf: %u buffers (%u KB)\n", nbufs, nbufs * BUF_SIZE / 1024);
+}
+
+/*
+ * The time in ms, for dirty ages. It wraps every 49 days or so;
+ * compare with signed differences.
+ */
+static
+uint32_t
+buf_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+////////////////////////////////////////////////////////////
+// Hash chains and LRU list; call with buf_spinlock
+
+static
+unsigned
+buf_hashfunc(struct fs *fs, daddr_t block)
+{
+	uint32_t x = (uint32_t)(uintptr_t)fs >> 4;
+
+	return (block ^ x ^ (x >> 7)) & (buf_hashsize - 1);
+}
+
+static
+struct buf *
+buf_find(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buf_hash[buf_hashfunc(fs, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_fs == fs && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_attach(struct buf *b, struct fs *fs, daddr_t block)
+{
+	unsigned ix = buf_hashfunc(fs, block);
+
+	KASSERT(b->b_fs == NULL);
+	b->b_fs = fs;
+	b->b_block = block;
+	b->b_hashnext = buf_hash[ix];
+	buf_hash[ix] = b;
+}
+
+static
+void
+buf_detach(struct buf *b)
+{
+	struct buf **bp;
+
+	KASSERT(b->b_fs != NULL);
+	bp = &buf_hash[buf_hashfunc(b->b_fs, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_fs = NULL;
+}
+
+static
+void
+buf_lru_remove(struct buf *b)
+{
+	b->b_lruprev->b_lrunext = b->b_lrunext;
+	b->b_lrunext->b_lruprev = b->b_lruprev;
+	b->b_lrunext = b->b_lruprev = NULL;
+}
+
+/*
+ * Put B on the LRU list: at the end (most recently used) if it holds
+ * something worth keeping, otherwise at the front to be reused first.
+ */
+static
+void
+buf_lru_insert(struct buf *b)
+{
+	struct buf *after;
+
+	after = (b->b_fs != NULL && b->b_valid) ? buf_lru.b_lruprev : &buf_lru;
+	b->b_lruprev = after;
+	b->b_lrunext = after->b_lrunext;
+	after->b_lrunext->b_lruprev = b;
+	after->b_lrunext = b;
+}
+
+/*
+ * Add a reference to B.
+ */
+static
+void
+buf_ref(struct buf *b)
+{
+	if (b->b_refcount == 0) {
+		buf_lru_remove(b);
+	}
+	b->b_refcount++;
+}
+
+/*
+ * Drop a reference to B; if it was the last, B becomes reusable.
+ */
+static
+void
+buf_unref(struct buf *b)
+{
+	KASSERT(b->b_refcount > 0);
+	b->b_refcount--;
+	if (b->b_refcount == 0) {
+		buf_lru_insert(b);
+		wchan_wakeone(buf_wchan, &buf_spinlock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// I/O; call with b_lock
+
+static
+int
+buf_readin(struct buf *b)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(b->b_lock));
+	KASSERT(!b->b_dirty);
+
+	result = FSOP_READBLOCK(b->b_fs, b->b_block, b->b_data, BUF_SIZE);
+	if (result) {
+		return result;
+	}
+	b->b_valid = true;
+
+	spinlock_acquire(&buf_spinlock);
+	buf_stats.bs_devreads++;
+	spinlock_release(&buf_spinlock);
+	return 0;
+}
+
+int
+buffer_writeout(struct buf *b)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(b->b_lock));
+
+	if (!b->b_dirty) {
+		return 0;
+	}
+	KASSERT(b->b_valid);
+	result = FSOP_WRITEBLOCK(b->b_fs, b->b_block, b->b_data, BUF_SIZE);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&buf_spinlock);
+	b->b_dirty = false;
+	KASSERT(buf_ndirty > 0);
+	buf_ndirty--;
+	buf_stats.bs_devwrites++;
+	spinlock_release(&buf_spinlock);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Getting and releasing buffers
+
+/*
+ * Find an unheld buffer to reuse and detach it from whatever it held,
+ * writing it back first if need be. Returns it with the only
+ * reference. Call with buf_spinlock; it may be released and retaken.
+ */
+static
+int
+buf_reclaim(struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	while (buf_lru.b_lrunext == &buf_lru) {
+		buf_stats.bs_waits++;
+		wchan_sleep(buf_wchan, &buf_spinlock);
+	}
+	b = buf_lru.b_lrunext;
+	buf_ref(b);
+
+	while (b->b_fs != NULL && b->b_dirty) {
+		/*
+		 * Leave it attached while it's written back, so nobody
+		 * reads the old contents off the disk meanwhile.
+		 */
+		buf_stats.bs_dirtyreuses++;
+		spinlock_release(&buf_spinlock);
+		lock_acquire(b->b_lock);
+		result = buffer_writeout(b);
+		lock_release(b->b_lock);
+		spinlock_acquire(&buf_spinlock);
+		if (result) {
+			buf_unref(b);
+			return result;
+		}
+		if (b->b_refcount > 1) {
+			/* Someone wants it after all; let them have it. */
+			buf_unref(b);
+			return EAGAIN;
+		}
+		/* Loop in case someone dirtied it again meanwhile. */
+	}
+
+	if (b->b_fs != NULL) {
+		buf_detach(b);
+		buf_stats.bs_reuses++;
+	}
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_readahead = false;
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_get(struct fs *fs, daddr_t block, struct buf **ret)
+{
+	struct buf *b, *nb;
+	int result;
+
+	KASSERT(fs->fs_ops->fsop_readblock != NULL);
+
+	spinlock_acquire(&buf_spinlock);
+	while (1) {
+		b = buf_find(fs, block);
+		if (b != NULL) {
+			buf_ref(b);
+			break;
+		}
+		result = buf_reclaim(&nb);
+		if (result == EAGAIN) {
+			continue;
+		}
+		if (result) {
+			spinlock_release(&buf_spinlock);
+			return result;
+		}
+		/* We may have slept; make sure nobody else cached it. */
+		if (buf_find(fs, block) != NULL) {
+			buf_unref(nb);
+			continue;
+		}
+		b = nb;
+		buf_attach(b, fs, block);
+		break;
+	}
+	spinlock_release(&buf_spinlock);
+
+	lock_acquire(b->b_lock);
+	KASSERT(b->b_fs == fs && b->b_block == block);
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_read(struct fs *fs, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	bool hit;
+	int result;
+
+	result = buffer_get(fs, block, &b);
+	if (result) {
+		return result;
+	}
+
+	hit = b->b_valid;
+	spinlock_acquire(&buf_spinlock);
+	buf_stats.bs_reads++;
+	if (hit) {
+		buf_stats.bs_hits++;
+	}
+	if (b->b_readahead) {
+		buf_stats.bs_rahits++;
+		b->b_readahead = false;
+	}
+	spinlock_release(&buf_spinlock);
+
+	if (!hit) {
+		result = buf_readin(b);
+		if (result) {
+			buffer_release(b);
+			return result;
+		}
+	}
+	*ret = b;
+	return 0;
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(b->b_lock));
+	return b->b_data;
+}
+
+bool
+buffer_isvalid(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(b->b_lock));
+	return b->b_valid;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(b->b_lock));
+	b->b_valid = true;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(lock_do_i_hold(b->b_lock));
+	KASSERT(b->b_valid);
+	if (b->b_dirty) {
+		return;
+	}
+	b->b_dirtysince = buf_now();
+
+	spinlock_acquire(&buf_spinlock);
+	b->b_dirty = true;
+	buf_ndirty++;
+	if (buf_ndirty == 1) {
+		/* The flusher sleeps while there's nothing to do. */
+		wchan_wakeone(fl_wchan, &buf_spinlock);
+	}
+	spinlock_release(&buf_spinlock);
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_release(b->b_lock);
+
+	spinlock_acquire(&buf_spinlock);
+	buf_unref(b);
+	spinlock_release(&buf_spinlock);
+}
+
+////////////////////////////////////////////////////////////
+// Read-ahead
+
+void
+buffer_readahead(struct fs *fs, daddr_t block)
+{
+	spinlock_acquire(&buf_spinlock);
+	if (buf_find(fs, block) != NULL) {
+		spinlock_release(&buf_spinlock);
+		return;
+	}
+	if (ra_count == BUF_RAQUEUE) {
+		buf_stats.bs_radropped++;
+		spinlock_release(&buf_spinlock);
+		return;
+	}
+	ra_queue[(ra_head + ra_count) % BUF_RAQUEUE].rr_fs = fs;
+	ra_queue[(ra_head + ra_count) % BUF_RAQUEUE].rr_block = block;
+	ra_count++;
+	buf_stats.bs_raqueued++;
+	wchan_wakeone(ra_wchan, &buf_spinlock);
+	spinlock_release(&buf_spinlock);
+}
+
+/*
+ * For read-ahead: attach a buffer to BLOCK of FS and lock it, but
+ * only if the block isn't cached, there is a free buffer to hand, and
+ * nobody else gets at it first; never waits for anything but a
+ * write-back. Call with buf_spinlock; it may be released and retaken.
+ */
+static
+int
+buf_getnew(struct fs *fs, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	if (buf_find(fs, block) != NULL) {
+		return EEXIST;
+	}
+	if (buf_lru.b_lrunext == &buf_lru) {
+		return ENOSPC;
+	}
+	result = buf_reclaim(&b);
+	if (result) {
+		return result;
+	}
+	if (buf_find(fs, block) != NULL) {
+		buf_unref(b);
+		return EEXIST;
+	}
+	buf_attach(b, fs, block);
+	if (!lock_tryacquire(b->b_lock)) {
+		buf_unref(b);
+		return EBUSY;
+	}
+	*ret = b;
+	return 0;
+}
+
+/*
+ * A read-ahead thread; its number is WHICH. Takes the request at the
+ * head of the queue, and any following it for the next blocks, and
+ * reads them in with one read. The run stops short at a block that
+ * has got cached meanwhile.
+ */
+static
+void
+buf_rathread(void *junk, unsigned long which)
+{
+	struct buf *run[BUF_RARUN];
+	struct rareq rr;
+	unsigned len, n, i;
+	int result;
+
+	(void)junk;
+	KASSERT(which < BUF_RATHREADS);
+
+	spinlock_acquire(&buf_spinlock);
+	while (1) {
+		while (ra_count == 0) {
+			wchan_sleep(ra_wchan, &buf_spinlock);
+		}
+		rr = ra_queue[ra_head];
+		ra_head = (ra_head + 1) % BUF_RAQUEUE;
+		ra_count--;
+		for (len = 1; len < BUF_RARUN && ra_count > 0; len++) {
+			if (ra_queue[ra_head].rr_fs != rr.rr_fs ||
+			    ra_queue[ra_head].rr_block != rr.rr_block + len) {
+				break;
+			}
+			ra_head = (ra_head + 1) % BUF_RAQUEUE;
+			ra_count--;
+		}
+		ra_busyfs[which] = rr.rr_fs;
+
+		for (n=0; n<len; n++) {
+			if (buf_getnew(rr.rr_fs, rr.rr_block + n, &run[n])) {
+				break;
+			}
+		}
+		spinlock_release(&buf_spinlock);
+
+		result = 0;
+		if (n > 0) {
+			result = FSOP_READBLOCK(rr.rr_fs, rr.rr_block,
+						ra_data[which], n * BUF_SIZE);
+		}
+		for (i=0; i<n; i++) {
+			if (result == 0) {
+				memcpy(run[i]->b_data,
+				       ra_data[which] + i * BUF_SIZE,
+				       BUF_SIZE);
+				run[i]->b_valid = true;
+				run[i]->b_readahead = true;
+			}
+			buffer_release(run[i]);
+		}
+
+		spinlock_acquire(&buf_spinlock);
+		if (n > 0 && result == 0) {
+			buf_stats.bs_devreads += n;
+			buf_stats.bs_raruns++;
+			buf_stats.bs_radone += n;
+		}
+		ra_busyfs[which] = NULL;
+		wchan_wakeall(ra_donewchan, &buf_spinlock);
+	}
+}
+
+/*
+ * Throw away FS's queued read-ahead requests and wait for those in
+ * progress, if any. Call with buf_spinlock.
+ */
+static
+void
+buf_racancel(struct fs *fs)
+{
+	unsigned i, n;
+	struct rareq *rr;
+
+	n = 0;
+	for (i=0; i<ra_count; i++) {
+		rr = &ra_queue[(ra_head + i) % BUF_RAQUEUE];
+		if (rr->rr_fs != fs) {
+			ra_queue[(ra_head + n) % BUF_RAQUEUE] = *rr;
+			n++;
+		}
+	}
+	ra_count = n;
+
+	i = 0;
+	while (i < BUF_RATHREADS) {
+		if (ra_busyfs[i] == fs) {
+			wchan_sleep(ra_donewchan, &buf_spinlock);
+			i = 0;
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Flusher
+
+/*
+ * Whether B could go out with the flusher's next write. Call with
+ * buf_spinlock.
+ */
+static
+bool
+buf_flushable(struct buf *b)
+{
+	return b->b_fs != NULL && b->b_dirty && b->b_refcount == 0;
+}
+
+/*
+ * Write back B, which must be flushable, along with the flushable
+ * buffers around it: the run of them containing B, or BUF_FLUSHRUN
+ * blocks of it. Call with buf_spinlock; it is released and retaken.
+ */
+static
+void
+buf_flushrun(struct buf *b)
+{
+	struct buf *run[BUF_FLUSHRUN];
+	struct fs *fs = b->b_fs;
+	daddr_t start;
+	unsigned n, i, j;
+	int result = 0;
+
+	KASSERT(buf_flushable(b));
+
+	/* Back up to the start of the run... */
+	start = b->b_block;
+	for (n=1; n<BUF_FLUSHRUN && start > 0; n++) {
+		b = buf_find(fs, start - 1);
+		if (b == NULL || !buf_flushable(b)) {
+			break;
+		}
+		start--;
+	}
+
+	/* ...and take it from there. */
+	for (n=0; n<BUF_FLUSHRUN; n++) {
+		b = buf_find(fs, start + n);
+		if (b == NULL || !buf_flushable(b)) {
+			break;
+		}
+		buf_ref(b);
+		run[n] = b;
+	}
+	KASSERT(n > 0);
+	fl_busyfs = fs;
+	spinlock_release(&buf_spinlock);
+
+	/*
+	 * Someone may have got at some of them since. Stop at the
+	 * first that's locked or has been cleaned meanwhile.
+	 */
+	for (i=0; i<n; i++) {
+		if (!lock_tryacquire(run[i]->b_lock)) {
+			break;
+		}
+		if (!run[i]->b_dirty) {
+			lock_release(run[i]->b_lock);
+			break;
+		}
+		memcpy(fl_data + i * BUF_SIZE, run[i]->b_data, BUF_SIZE);
+	}
+	if (i > 0) {
+		/* If this fails they stay dirty and we try again later. */
+		result = FSOP_WRITEBLOCK(fs, start, fl_data, i * BUF_SIZE);
+	}
+
+	spinlock_acquire(&buf_spinlock);
+	if (i > 0 && result == 0) {
+		for (j=0; j<i; j++) {
+			run[j]->b_dirty = false;
+		}
+		KASSERT(buf_ndirty >= i);
+		buf_ndirty -= i;
+		buf_stats.bs_devwrites += i;
+		buf_stats.bs_flushruns++;
+		buf_stats.bs_flushblocks += i;
+	}
+	spinlock_release(&buf_spinlock);
+
+	for (j=0; j<i; j++) {
+		lock_release(run[j]->b_lock);
+	}
+
+	spinlock_acquire(&buf_spinlock);
+	for (j=0; j<n; j++) {
+		buf_unref(run[j]);
+	}
+	fl_busyfs = NULL;
+	wchan_wakeall(fl_donewchan, &buf_spinlock);
+}
+
+/*
+ * One look over the buffers: write back those that are too old, or
+ * any at all while too many are dirty.
+ */
+static
+void
+buf_flushpass(void)
+{
+	struct buf *b;
+	uint32_t now;
+	bool draining;
+	unsigned i;
+
+	now = buf_now();
+	spinlock_acquire(&buf_spinlock);
+	draining = buf_ndirty > nbufs / BUF_DIRTYHI;
+	spinlock_release(&buf_spinlock);
+
+	for (i=0; i<nbufs; i++) {
+		b = &bufs[i];
+
+		/* Unlocked peek, as in buffer_sync_fs. */
+		if (!b->b_dirty) {
+			continue;
+		}
+
+		spinlock_acquire(&buf_spinlock);
+		if (draining && buf_ndirty <= nbufs / BUF_DIRTYLO) {
+			draining = false;
+		}
+		if (buf_flushable(b) &&
+		    (draining ||
+		     (int32_t)(now - b->b_dirtysince) >= BUF_MAXAGE)) {
+			buf_flushrun(b);
+		}
+		spinlock_release(&buf_spinlock);
+	}
+}
+
+/*
+ * The flusher thread. Sleeps until something is dirty, then makes a
+ * pass every BUF_FLUSHWAKE ms until nothing is.
+ */
+static
+void
+buf_flushthread(void *junk1, unsigned long junk2)
+{
+	struct timespec when, interval;
+
+	(void)junk1;
+	(void)junk2;
+
+	interval.tv_sec = 0;
+	interval.tv_nsec = BUF_FLUSHWAKE * 1000000;
+
+	while (1) {
+		spinlock_acquire(&buf_spinlock);
+		while (buf_ndirty == 0) {
+			wchan_sleep(fl_wchan, &buf_spinlock);
+		}
+		spinlock_release(&buf_spinlock);
+
+		gettime(&when);
+		timespec_add(&when, &interval, &when);
+		clocksleep_until(&when);
+
+		buf_flushpass();
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Whole blocks and file systems
+
+void
+buffer_invalidate(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+
+	spinlock_acquire(&buf_spinlock);
+	b = buf_find(fs, block);
+	if (b == NULL) {
+		spinlock_release(&buf_spinlock);
+		return;
+	}
+	buf_ref(b);
+	spinlock_release(&buf_spinlock);
+
+	lock_acquire(b->b_lock);
+	b->b_valid = false;
+	if (b->b_dirty) {
+		spinlock_acquire(&buf_spinlock);
+		b->b_dirty = false;
+		buf_ndirty--;
+		spinlock_release(&buf_spinlock);
+	}
+	buffer_release(b);
+}
+
+int
+buffer_flush(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+	int result;
+
+	spinlock_acquire(&buf_spinlock);
+	b = buf_find(fs, block);
+	if (b == NULL || (b->b_refcount == 0 && !b->b_dirty)) {
+		spinlock_release(&buf_spinlock);
+		return 0;
+	}
+	buf_ref(b);
+	spinlock_release(&buf_spinlock);
+
+	lock_acquire(b->b_lock);
+	result = buffer_writeout(b);
+	buffer_release(b);
+	return result;
+}
+
+int
+buffer_sync_fs(struct fs *fs)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	for (i=0; i<nbufs; i++) {
+		b = &bufs[i];
+
+		/* Unlocked peek; buffers dirtied after we pass are missed. */
+		if (b->b_fs != fs || !b->b_dirty) {
+			continue;
+		}
+
+		spinlock_acquire(&buf_spinlock);
+		if (b->b_fs != fs) {
+			spinlock_release(&buf_spinlock);
+			continue;
+		}
+		buf_ref(b);
+		spinlock_release(&buf_spinlock);
+
+		lock_acquire(b->b_lock);
+		result = buffer_writeout(b);
+		buffer_release(b);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+void
+buffer_drop_fs(struct fs *fs)
+{
+	struct buf *b;
+	unsigned i;
+
+	spinlock_acquire(&buf_spinlock);
+	buf_racancel(fs);
+	while (fl_busyfs == fs) {
+		wchan_sleep(fl_donewchan, &buf_spinlock);
+	}
+	for (i=0; i<nbufs; i++) {
+		b = &bufs[i];
+		if (b->b_fs != fs) {
+			continue;
+		}
+		KASSERT(b->b_refcount == 0);
+		KASSERT(!b->b_dirty);
+		buf_detach(b);
+		b->b_valid = false;
+		buf_lru_remove(b);
+		buf_lru_insert(b);
+	}
+	spinlock_release(&buf_spinlock);
+}
+
+////////////////////////////////////////////////////////////
+// Stats
+
+void
+buffer_printstats(bool clear)
+{
+	struct bufstats bs;
+	unsigned i, held = 0, attached = 0, dirty = 0;
+
+	spinlock_acquire(&buf_spinlock);
+	bs = buf_stats;
+	if (clear) {
+		bzero(&buf_stats, sizeof(buf_stats));
+	}
+	for (i=0; i<nbufs; i++) {
+		if (bufs[i].b_refcount > 0) {
+			held++;
+		}
+		if (bufs[i].b_fs != NULL) {
+			attached++;
+			if (bufs[i].b_dirty) {
+				dirty++;
+			}
+		}
+	}
+	spinlock_release(&buf_spinlock);
+
+	kprintf("Buffers: %u total, %u in use, %u held, %u dirty\n",
+		nbufs, attached, held, dirty);
+	kprintf("Reads: %lu, hits %lu (%lu%%)\n", bs.bs_reads, bs.bs_hits,
+		bs.bs_reads ? bs.bs_hits * 100 / bs.bs_reads : 0);
+	kprintf("Disk: %lu reads, %lu writes\n",
+		bs.bs_devreads, bs.bs_devwrites);
+	kprintf("Reused %lu buffers (%lu written back first); "
+		"waited %lu times\n", bs.bs_reuses, bs.bs_dirtyreuses,
+		bs.bs_waits);
+	kprintf("Read-ahead: %lu queued, %lu dropped, %lu read in %lu "
+		"reads, %lu used (%lu%%)\n", bs.bs_raqueued, bs.bs_radropped,
+		bs.bs_radone, bs.bs_raruns, bs.bs_rahits,
+		bs.bs_radone ? bs.bs_rahits * 100 / bs.bs_radone : 0);
+	kprintf("Flusher: %lu blocks in %lu writes (%lu per write)\n",
+		bs.bs_flushblocks, bs.bs_flushruns,
+		bs.bs_flushruns ? bs.bs_flushblocks / bs.bs_flushruns : 0);
+}
@@ -237,15 +237,17 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Mappings are paged with VOP_READ and VOP_WRITE and expect
+ * file semantics (zeros past the end), which devices don't have:
+ * character devices can't seek, and block devices fail I/O past
+ * their last block. So no device can be mapped.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return ENODEV;
 }
 
 /*
@@ -0,0 +1,288 @@
+/*
+ * Block I/O scheduler. See iosched.h.
+ *
+ * Every queued request is on two lists at once, both headed by
+ * is_queue: one kept sorted by sector, for the elevator, and one in
+ * arrival order, for fifo and for the deadlines. A policy just picks
+ * which request goes next; iosched_next then gathers up its
+ * neighbours on the disk and takes them all off the queue.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <iosched.h>
+
+#define IOSCHED_READEXPIRE	500	/* ms */
+#define IOSCHED_WRITEEXPIRE	5000	/* ms */
+#define IOSCHED_MAXMERGE	128	/* most sectors in one run */
+
+struct iosched_policy {
+	const char *ip_name;
+	struct iosched_node *(*ip_pick)(struct iosched *is);
+};
+
+static struct spinlock iosched_listlock = SPINLOCK_INITIALIZER;
+static struct iosched *iosched_list;
+
+/*
+ * The time in ms, for deadlines. Compare with signed differences.
+ */
+static
+uint32_t
+iosched_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+////////////////////////////////////////////////////////////
+// Policies
+
+static
+struct iosched_node *
+iosched_fifo_pick(struct iosched *is)
+{
+	return is->is_queue.in_fifonext;
+}
+
+static
+struct iosched_node *
+iosched_clook_pick(struct iosched *is)
+{
+	struct iosched_node *in;
+
+	/* The first request at or beyond the head... */
+	for (in = is->is_queue.in_sortnext; in != &is->is_queue;
+	     in = in->in_sortnext) {
+		if (in->in_sector >= is->is_headpos) {
+			return in;
+		}
+	}
+	/* ...or if there isn't one, the lowest. */
+	return is->is_queue.in_sortnext;
+}
+
+static
+struct iosched_node *
+iosched_deadline_pick(struct iosched *is)
+{
+	struct iosched_node *in, *best = NULL;
+	uint32_t now = iosched_now();
+
+	/* The expired request with the earliest deadline, if any. */
+	for (in = is->is_queue.in_fifonext; in != &is->is_queue;
+	     in = in->in_fifonext) {
+		if ((int32_t)(now - in->in_deadline) < 0) {
+			continue;
+		}
+		if (best == NULL ||
+		    (int32_t)(in->in_deadline - best->in_deadline) < 0) {
+			best = in;
+		}
+	}
+	if (best != NULL) {
+		is->is_expired++;
+		return best;
+	}
+	return iosched_clook_pick(is);
+}
+
+static const struct iosched_policy iosched_policies[] = {
+	{ "fifo", iosched_fifo_pick },
+	{ "clook", iosched_clook_pick },
+	{ "deadline", iosched_deadline_pick },
+	{ NULL, NULL },
+};
+
+#define IOSCHED_DEFAULT		(&iosched_policies[2])
+
+////////////////////////////////////////////////////////////
+// Queue
+
+void
+iosched_init(struct iosched *is, const char *name, struct spinlock *lk)
+{
+	snprintf(is->is_name, sizeof(is->is_name), "%s", name);
+	is->is_lock = lk;
+	is->is_policy = IOSCHED_DEFAULT;
+	is->is_queue.in_sortprev = is->is_queue.in_sortnext = &is->is_queue;
+	is->is_queue.in_fifoprev = is->is_queue.in_fifonext = &is->is_queue;
+	is->is_count = 0;
+	is->is_headpos = 0;
+	is->is_requests = 0;
+	is->is_transfers = 0;
+	is->is_expired = 0;
+	is->is_seekdist = 0;
+
+	spinlock_acquire(&iosched_listlock);
+	is->is_nextsched = iosched_list;
+	iosched_list = is;
+	spinlock_release(&iosched_listlock);
+}
+
+void
+iosched_add(struct iosched *is, struct iosched_node *in)
+{
+	struct iosched_node *after;
+
+	KASSERT(spinlock_do_i_hold(is->is_lock));
+	KASSERT(in->in_nsect > 0);
+
+	in->in_merged = NULL;
+	in->in_deadline = iosched_now() +
+		(in->in_write ? IOSCHED_WRITEEXPIRE : IOSCHED_READEXPIRE);
+
+	/* At the end in arrival order... */
+	in->in_fifoprev = is->is_queue.in_fifoprev;
+	in->in_fifonext = &is->is_queue;
+	in->in_fifoprev->in_fifonext = in;
+	is->is_queue.in_fifoprev = in;
+
+	/* ...and after any at the same place in sector order. */
+	after = is->is_queue.in_sortprev;
+	while (after != &is->is_queue && after->in_sector > in->in_sector) {
+		after = after->in_sortprev;
+	}
+	in->in_sortprev = after;
+	in->in_sortnext = after->in_sortnext;
+	after->in_sortnext->in_sortprev = in;
+	after->in_sortnext = in;
+
+	is->is_count++;
+}
+
+static
+void
+iosched_remove(struct iosched *is, struct iosched_node *in)
+{
+	in->in_sortprev->in_sortnext = in->in_sortnext;
+	in->in_sortnext->in_sortprev = in->in_sortprev;
+	in->in_fifoprev->in_fifonext = in->in_fifonext;
+	in->in_fifonext->in_fifoprev = in->in_fifoprev;
+	in->in_sortprev = in->in_sortnext = NULL;
+	in->in_fifoprev = in->in_fifonext = NULL;
+	KASSERT(is->is_count > 0);
+	is->is_count--;
+}
+
+/*
+ * Whether B starts where A leaves off, going the same way.
+ */
+static
+bool
+iosched_adjacent(struct iosched_node *a, struct iosched_node *b)
+{
+	return a->in_write == b->in_write &&
+		a->in_sector + a->in_nsect == b->in_sector;
+}
+
+struct iosched_node *
+iosched_next(struct iosched *is)
+{
+	struct iosched_node *first, *last, *in;
+	uint32_t nsect;
+
+	KASSERT(spinlock_do_i_hold(is->is_lock));
+
+	if (is->is_count == 0) {
+		return NULL;
+	}
+	first = is->is_policy->ip_pick(is);
+	nsect = first->in_nsect;
+
+	/* Take in whatever leads up to it... */
+	while (first->in_sortprev != &is->is_queue &&
+	       iosched_adjacent(first->in_sortprev, first) &&
+	       nsect + first->in_sortprev->in_nsect <= IOSCHED_MAXMERGE) {
+		first = first->in_sortprev;
+		nsect += first->in_nsect;
+	}
+
+	/* ...and whatever follows on. */
+	last = first;
+	while (last->in_sortnext != &is->is_queue &&
+	       iosched_adjacent(last, last->in_sortnext) &&
+	       nsect + last->in_sortnext->in_nsect <= IOSCHED_MAXMERGE) {
+		last->in_merged = last->in_sortnext;
+		last = last->in_sortnext;
+		nsect += last->in_nsect;
+	}
+	last->in_merged = NULL;
+
+	for (in = first; in != NULL; in = in->in_merged) {
+		iosched_remove(is, in);
+		is->is_requests++;
+	}
+
+	is->is_transfers++;
+	is->is_seekdist += first->in_sector >= is->is_headpos ?
+		first->in_sector - is->is_headpos :
+		is->is_headpos - first->in_sector;
+	is->is_headpos = last->in_sector + last->in_nsect;
+
+	return first;
+}
+
+////////////////////////////////////////////////////////////
+// Menu
+
+int
+iosched_setpolicy(const char *name)
+{
+	const struct iosched_policy *ip;
+	struct iosched *is;
+
+	for (ip = iosched_policies; ip->ip_name != NULL; ip++) {
+		if (!strcmp(ip->ip_name, name)) {
+			break;
+		}
+	}
+	if (ip->ip_name == NULL) {
+		return EINVAL;
+	}
+
+	/* Disks don't go away, so the list only needs the lock to add. */
+	for (is = iosched_list; is != NULL; is = is->is_nextsched) {
+		spinlock_acquire(is->is_lock);
+		is->is_policy = ip;
+		spinlock_release(is->is_lock);
+	}
+	return 0;
+}
+
+void
+iosched_printstats(bool clear)
+{
+	struct iosched *is, copy;
+
+	if (iosched_list == NULL) {
+		kprintf("No disks.\n");
+		return;
+	}
+
+	for (is = iosched_list; is != NULL; is = is->is_nextsched) {
+		spinlock_acquire(is->is_lock);
+		copy = *is;
+		if (clear) {
+			is->is_requests = 0;
+			is->is_transfers = 0;
+			is->is_expired = 0;
+			is->is_seekdist = 0;
+		}
+		spinlock_release(is->is_lock);
+
+		kprintf("%s: %s, %u queued; %lu requests in %lu transfers, "
+			"%lu by deadline\n", copy.is_name,
+			copy.is_policy->ip_name, copy.is_count,
+			copy.is_requests, copy.is_transfers, copy.is_expired);
+		kprintf("%s: seek distance %llu sectors (%llu per transfer)\n",
+			copy.is_name, (unsigned long long)copy.is_seekdist,
+			(unsigned long long)(copy.is_transfers ?
+			   copy.is_seekdist / copy.is_transfers : 0));
+	}
+}
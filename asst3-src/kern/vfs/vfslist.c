@@ -94,6 +94,9 @@ static struct knowndevarray *knowndevs;
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
 
+/* Protects knowndevs, and the boot filesystem in vfslookup.c. */
+static struct rwlock *vfs_namelock;
+
 
 /*
  * Setup function
@@ -112,6 +115,11 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_namelock = rwlock_create("vfs_namelock");
+	if (vfs_namelock==NULL) {
+		panic("vfs: Could not create vfs name lock\n");
+	}
+
 	devnull_create();
 	semfs_bootstrap();
 }
@@ -166,6 +174,41 @@ vfs_biglock_do_i_hold(void)
 	return lock_do_i_hold(vfs_biglock);
 }
 
+/*
+ * Operations on vfs_namelock. Unlike the big lock this is not
+ * recursive: a reader taking it again could deadlock behind a
+ * waiting writer.
+ */
+void
+vfs_namelock_acquire_read(void)
+{
+	rwlock_acquire_read(vfs_namelock);
+}
+
+void
+vfs_namelock_release_read(void)
+{
+	rwlock_release_read(vfs_namelock);
+}
+
+void
+vfs_namelock_acquire_write(void)
+{
+	rwlock_acquire_write(vfs_namelock);
+}
+
+void
+vfs_namelock_release_write(void)
+{
+	rwlock_release_write(vfs_namelock);
+}
+
+bool
+vfs_namelock_do_i_hold_write(void)
+{
+	return rwlock_do_i_hold_write(vfs_namelock);
+}
+
 /*
  * Global sync function - call FSOP_SYNC on all devices.
  */
@@ -175,6 +218,7 @@ vfs_sync(void)
 	struct knowndev *dev;
 	unsigned i, num;
 
+	vfs_namelock_acquire_read();
 	vfs_biglock_acquire();
 
 	num = knowndevarray_num(knowndevs);
@@ -186,22 +230,22 @@ vfs_sync(void)
 	}
 
 	vfs_biglock_release();
+	vfs_namelock_release_read();
 
 	return 0;
 }
 
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
- * back an appropriate vnode.
+ * back an appropriate vnode. Call with vfs_namelock held.
  */
+static
 int
-vfs_getroot(const char *devname, struct vnode **ret)
+getroot(const char *devname, struct vnode **ret)
 {
 	struct knowndev *kd;
 	unsigned i, num;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -270,6 +314,17 @@ vfs_getroot(const char *devname, struct vnode **ret)
 	return ENODEV;
 }
 
+int
+vfs_getroot(const char *devname, struct vnode **ret)
+{
+	int result;
+
+	vfs_namelock_acquire_read();
+	result = getroot(devname, ret);
+	vfs_namelock_release_read();
+	return result;
+}
+
 /*
  * Given a filesystem, hand back the name of the device it's mounted on.
  */
@@ -277,11 +332,12 @@ const char *
 vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
+	const char *name = NULL;
 	unsigned i, num;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	vfs_namelock_acquire_read();
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -294,11 +350,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
 
-	return NULL;
+	vfs_namelock_release_read();
+	return name;
 }
 
 /*
@@ -358,7 +416,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(vfs_namelock_do_i_hold_write());
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -401,6 +459,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	/* Silence warning with gcc 4.8 -Og (but not -O2) */
 	index = 0;
 
+	vfs_namelock_acquire_write();
 	vfs_biglock_acquire();
 
 	name = kstrdup(dname);
@@ -454,6 +513,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	}
 
 	vfs_biglock_release();
+	vfs_namelock_release_write();
 	return 0;
 
  fail:
@@ -471,6 +531,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	}
 
 	vfs_biglock_release();
+	vfs_namelock_release_write();
 	return result;
 }
 
@@ -509,7 +570,7 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(vfs_namelock_do_i_hold_write());
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -543,16 +604,19 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
+	vfs_namelock_acquire_write();
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
 	if (result) {
 		vfs_biglock_release();
+		vfs_namelock_release_write();
 		return result;
 	}
 
 	if (kd->kd_fs != NULL) {
 		vfs_biglock_release();
+		vfs_namelock_release_write();
 		return EBUSY;
 	}
 	KASSERT(kd->kd_rawname != NULL);
@@ -561,6 +625,7 @@ vfs_mount(const char *devname, void *data,
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
 		vfs_biglock_release();
+		vfs_namelock_release_write();
 		return result;
 	}
 
@@ -574,6 +639,7 @@ vfs_mount(const char *devname, void *data,
 		volname ? volname : kd->kd_name, kd->kd_name);
 
 	vfs_biglock_release();
+	vfs_namelock_release_write();
 	return 0;
 }
 
@@ -601,6 +667,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 		devname = myname;
 	}
 
+	vfs_namelock_acquire_write();
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -623,6 +690,7 @@ vfs_swapon(const char *devname, struct vnode **ret)
 
  out:
 	vfs_biglock_release();
+	vfs_namelock_release_write();
 	if (myname != NULL) {
 		kfree(myname);
 	}
@@ -640,6 +708,7 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
+	vfs_namelock_acquire_write();
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -674,6 +743,7 @@ vfs_unmount(const char *devname)
 
  fail:
 	vfs_biglock_release();
+	vfs_namelock_release_write();
 	return result;
 }
 
@@ -690,6 +760,7 @@ vfs_swapoff(const char *devname)
 	struct knowndev *kd;
 	int result;
 
+	vfs_namelock_acquire_write();
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -711,6 +782,7 @@ vfs_swapoff(const char *devname)
 
  fail:
 	vfs_biglock_release();
+	vfs_namelock_release_write();
 	return result;
 }
 
@@ -724,6 +796,7 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
+	vfs_namelock_acquire_write();
 	vfs_biglock_acquire();
 
 	num = knowndevarray_num(knowndevs);
@@ -781,6 +854,7 @@ vfs_unmountall(void)
 	}
 
 	vfs_biglock_release();
+	vfs_namelock_release_write();
 
 	return 0;
 }
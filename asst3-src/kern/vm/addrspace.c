@@ -32,11 +32,13 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <vnode.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -52,15 +54,32 @@ struct addrspace *
 as_create(void)
 {
         struct addrspace *as;
+        unsigned i;
 
         as = kmalloc(sizeof(struct addrspace));
         if (as == NULL) {
                 return NULL;
         }
 
-        /*
-         * Initialize as needed.
-         */
+        as->as_regions = NULL;
+        as->as_heap = NULL;
+        as->as_brk = 0;
+        as->as_cpus = 0;
+        for (i=0; i<MAXCPUS; i++) {
+                as->as_asid[i] = 0;
+        }
+
+        as->as_lock = lock_create("addrspace");
+        if (as->as_lock == NULL) {
+                kfree(as);
+                return NULL;
+        }
+
+        if (pt_create(as)) {
+                lock_destroy(as->as_lock);
+                kfree(as);
+                return NULL;
+        }
 
         return as;
 }
@@ -68,18 +87,56 @@ as_create(void)
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
+        struct tlbshootdown ts;
         struct addrspace *newas;
+        struct region *rg, *newrg, **tail;
+        int result;
 
         newas = as_create();
         if (newas==NULL) {
                 return ENOMEM;
         }
 
-        /*
-         * Write this.
-         */
+        lock_acquire(old->as_lock);
+        lock_acquire(newas->as_lock);
+
+        tail = &newas->as_regions;
+        for (rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+                newrg = kmalloc(sizeof(struct region));
+                if (newrg == NULL) {
+                        lock_release(newas->as_lock);
+                        lock_release(old->as_lock);
+                        as_destroy(newas);
+                        return ENOMEM;
+                }
+                *newrg = *rg;
+                newrg->rg_next = NULL;
+                if (rg == old->as_heap) {
+                        newas->as_heap = newrg;
+                }
+                if (newrg->rg_vnode != NULL) {
+                        VOP_INCREF(newrg->rg_vnode);
+                }
+                *tail = newrg;
+                tail = &newrg->rg_next;
+        }
 
-        (void)old;
+        newas->as_brk = old->as_brk;
+
+        result = pt_copy(old, newas);
+
+        /* OLD's pages are now read-only; drop writeable translations. */
+        vm_shootdown_init(&ts, old);
+        ts.ts_all = true;
+        vm_shootdown_send(&ts);
+
+        lock_release(newas->as_lock);
+        lock_release(old->as_lock);
+
+        if (result) {
+                as_destroy(newas);
+                return result;
+        }
 
         *ret = newas;
         return 0;
@@ -88,10 +145,29 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
-        /*
-         * Clean up as needed.
-         */
+        struct region *rg;
+
+        /* Wait out any page-out in progress. */
+        lock_acquire(as->as_lock);
+        for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+                if (rg->rg_flags & RG_SHARED) {
+                        /* Nobody to report an error to. */
+                        (void)vm_syncregion(as, rg);
+                }
+        }
+        pt_destroy(as);
+        lock_release(as->as_lock);
+
+        while (as->as_regions != NULL) {
+                rg = as->as_regions;
+                as->as_regions = rg->rg_next;
+                if (rg->rg_vnode != NULL) {
+                        VOP_DECREF(rg->rg_vnode);
+                }
+                kfree(rg);
+        }
 
+        lock_destroy(as->as_lock);
         kfree(as);
 }
 
@@ -109,19 +185,30 @@ as_activate(void)
                 return;
         }
 
-        /*
-         * Write this.
-         */
+        vm_tlbactivate(as);
 }
 
 void
 as_deactivate(void)
 {
-        /*
-         * Write this. For many designs it won't need to actually do
-         * anything. See proc.c for an explanation of why it (might)
-         * be needed.
-         */
+        vm_tlbdeactivate();
+}
+
+/*
+ * Return the region containing VADDR, or NULL if it isn't in one.
+ */
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+        struct region *rg;
+
+        for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+                if (vaddr >= rg->rg_vbase &&
+                    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+                        return rg;
+                }
+        }
+        return NULL;
 }
 
 /*
@@ -130,57 +217,142 @@ as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. The
+ * MIPS TLB can't express read or execute permission separately, so
+ * only WRITEABLE is enforced.
+ *
+ * The region is widened to whole pages. Nothing is allocated for it
+ * until its pages are touched.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
                  int readable, int writeable, int executable)
 {
-        /*
-         * Write this.
-         */
+        struct region *rg;
+        size_t npages;
 
-        (void)as;
-        (void)vaddr;
-        (void)memsize;
-        (void)readable;
-        (void)writeable;
-        (void)executable;
-        return ENOSYS; /* Unimplemented */
+        memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+        vaddr &= PAGE_FRAME;
+        npages = (memsize + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        if (npages == 0 || vaddr >= USERSPACETOP ||
+            npages > (USERSPACETOP - vaddr) / PAGE_SIZE) {
+                return EFAULT;
+        }
+
+        rg = kmalloc(sizeof(struct region));
+        if (rg == NULL) {
+                return ENOMEM;
+        }
+        rg->rg_vbase = vaddr;
+        rg->rg_npages = npages;
+        rg->rg_flags = (readable ? RG_READ : 0) |
+                (writeable ? RG_WRITE : 0) |
+                (executable ? RG_EXEC : 0);
+        rg->rg_vnode = NULL;
+        rg->rg_offset = 0;
+        rg->rg_filevaddr = vaddr;
+        rg->rg_filesize = 0;
+
+        lock_acquire(as->as_lock);
+        rg->rg_next = as->as_regions;
+        as->as_regions = rg;
+        lock_release(as->as_lock);
+
+        return 0;
+}
+
+/*
+ * Arrange for the region containing VADDR to be filled from V: the
+ * FILESIZE bytes at VADDR come from the file at OFFSET. Nothing is
+ * read now; vm_fault reads each page when it is first touched, and
+ * zero-fills whatever lies beyond FILESIZE.
+ */
+int
+as_define_filedata(struct addrspace *as, vaddr_t vaddr, size_t filesize,
+                   struct vnode *v, off_t offset)
+{
+        struct region *rg;
+
+        lock_acquire(as->as_lock);
+        rg = as_findregion(as, vaddr);
+        if (rg == NULL || rg->rg_vnode != NULL ||
+            filesize > rg->rg_vbase + rg->rg_npages * PAGE_SIZE - vaddr) {
+                lock_release(as->as_lock);
+                return EINVAL;
+        }
+        VOP_INCREF(v);
+        rg->rg_vnode = v;
+        rg->rg_offset = offset;
+        rg->rg_filevaddr = vaddr;
+        rg->rg_filesize = filesize;
+        lock_release(as->as_lock);
+
+        return 0;
 }
 
 int
 as_prepare_load(struct addrspace *as)
 {
         /*
-         * Write this.
+         * Nothing to do: segments are paged in from the file by
+         * vm_fault, so the loader never writes to user memory.
          */
-
         (void)as;
         return 0;
 }
 
+/*
+ * Now that the segments are in place, start the (empty) heap at the
+ * first page above the highest of them.
+ */
 int
 as_complete_load(struct addrspace *as)
 {
-        /*
-         * Write this.
-         */
+        struct region *rg, *heap;
+        vaddr_t top;
 
-        (void)as;
+        heap = kmalloc(sizeof(struct region));
+        if (heap == NULL) {
+                return ENOMEM;
+        }
+
+        lock_acquire(as->as_lock);
+        KASSERT(as->as_heap == NULL);
+
+        top = 0;
+        for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+                if (rg->rg_vbase + rg->rg_npages * PAGE_SIZE > top) {
+                        top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+                }
+        }
+
+        heap->rg_vbase = top;
+        heap->rg_npages = 0;
+        heap->rg_flags = RG_READ | RG_WRITE;
+        heap->rg_vnode = NULL;
+        heap->rg_offset = 0;
+        heap->rg_filevaddr = top;
+        heap->rg_filesize = 0;
+        heap->rg_next = as->as_regions;
+        as->as_regions = heap;
+        as->as_heap = heap;
+        as->as_brk = top;
+
+        lock_release(as->as_lock);
         return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-        /*
-         * Write this.
-         */
+        int result;
 
-        (void)as;
+        result = as_define_region(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+                                  VM_STACKPAGES * PAGE_SIZE, 1, 1, 0);
+        if (result) {
+                return result;
+        }
 
         /* Initial user-level stack pointer */
         *stackptr = USERSTACK;
@@ -188,3 +360,180 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
         return 0;
 }
 
+/*
+ * Move the break by AMOUNT bytes. Growing only extends the heap
+ * region (pages are zero-filled when first touched), so it fails
+ * only if the heap would run into another region. Shrinking frees the
+ * frames of the pages given up right away.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbrk)
+{
+        struct region *heap, *rg;
+        vaddr_t brk, newbrk, end;
+        size_t npages;
+
+        lock_acquire(as->as_lock);
+
+        heap = as->as_heap;
+        if (heap == NULL) {
+                lock_release(as->as_lock);
+                return ENOMEM;
+        }
+        brk = as->as_brk;
+
+        if (amount < 0) {
+                if ((vaddr_t)-amount > brk - heap->rg_vbase) {
+                        lock_release(as->as_lock);
+                        return EINVAL;
+                }
+        }
+        else if ((vaddr_t)amount > USERSPACETOP - brk) {
+                lock_release(as->as_lock);
+                return ENOMEM;
+        }
+        newbrk = brk + amount;
+        npages = (newbrk - heap->rg_vbase + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        if (npages > heap->rg_npages) {
+                end = heap->rg_vbase + npages * PAGE_SIZE;
+                for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+                        if (rg != heap && rg->rg_vbase < end &&
+                            rg->rg_vbase + rg->rg_npages * PAGE_SIZE >
+                            heap->rg_vbase) {
+                                lock_release(as->as_lock);
+                                return ENOMEM;
+                        }
+                }
+        }
+        else if (npages < heap->rg_npages) {
+                pt_unmap(as, heap->rg_vbase + npages * PAGE_SIZE,
+                         heap->rg_npages - npages);
+        }
+
+        heap->rg_npages = npages;
+        as->as_brk = newbrk;
+        *oldbrk = brk;
+
+        lock_release(as->as_lock);
+        return 0;
+}
+
+/*
+ * Find NPAGES free pages for a mapping, as high as possible below
+ * the stack: start at the top of user space and, while the candidate
+ * range overlaps a region, move it down below that region. Fails if
+ * that runs into the heap. Call with as_lock held.
+ */
+static
+int
+as_findgap(struct addrspace *as, size_t npages, vaddr_t *ret)
+{
+        struct region *rg;
+        vaddr_t top, bottom, len;
+        bool moved;
+
+        len = npages * PAGE_SIZE;
+        bottom = as->as_heap != NULL ?
+                as->as_heap->rg_vbase + as->as_heap->rg_npages * PAGE_SIZE : 0;
+        top = USERSPACETOP;
+
+        do {
+                if (top < bottom || npages > (top - bottom) / PAGE_SIZE) {
+                        return ENOMEM;
+                }
+                moved = false;
+                for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+                        if (rg->rg_vbase < top &&
+                            rg->rg_vbase + rg->rg_npages * PAGE_SIZE >
+                            top - len) {
+                                top = rg->rg_vbase;
+                                moved = true;
+                        }
+                }
+        } while (moved);
+
+        *ret = top - len;
+        return 0;
+}
+
+/*
+ * Map NPAGES pages of V, starting at file offset OFFSET (which must
+ * be page-aligned), read-only or read-write. Nothing is read now:
+ * pages come straight from the file when they are first touched, as
+ * for executables.
+ */
+int
+as_mmap(struct addrspace *as, size_t npages, int writeable,
+        struct vnode *v, off_t offset, vaddr_t *ret)
+{
+        struct region *rg;
+        vaddr_t vaddr;
+        int result;
+
+        KASSERT(npages > 0);
+        KASSERT(offset % PAGE_SIZE == 0);
+
+        rg = kmalloc(sizeof(struct region));
+        if (rg == NULL) {
+                return ENOMEM;
+        }
+
+        lock_acquire(as->as_lock);
+        result = as_findgap(as, npages, &vaddr);
+        if (result) {
+                lock_release(as->as_lock);
+                kfree(rg);
+                return result;
+        }
+
+        rg->rg_vbase = vaddr;
+        rg->rg_npages = npages;
+        rg->rg_flags = RG_READ | RG_SHARED | (writeable ? RG_WRITE : 0);
+        rg->rg_vnode = v;
+        rg->rg_offset = offset;
+        rg->rg_filevaddr = vaddr;
+        rg->rg_filesize = npages * PAGE_SIZE;
+        VOP_INCREF(v);
+
+        rg->rg_next = as->as_regions;
+        as->as_regions = rg;
+        lock_release(as->as_lock);
+
+        *ret = vaddr;
+        return 0;
+}
+
+/*
+ * Undo the as_mmap that returned VADDR: write back what was modified,
+ * then drop the pages and the region. The mapping goes away even if
+ * the write-back fails; the error is still returned.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr)
+{
+        struct region *rg, **prev;
+        int result;
+
+        lock_acquire(as->as_lock);
+        for (prev = &as->as_regions; *prev != NULL; prev = &(*prev)->rg_next) {
+                if ((*prev)->rg_vbase == vaddr &&
+                    ((*prev)->rg_flags & RG_SHARED)) {
+                        break;
+                }
+        }
+        rg = *prev;
+        if (rg == NULL) {
+                lock_release(as->as_lock);
+                return EINVAL;
+        }
+
+        result = vm_syncregion(as, rg);
+        pt_unmap(as, rg->rg_vbase, rg->rg_npages);
+        *prev = rg->rg_next;
+        lock_release(as->as_lock);
+
+        VOP_DECREF(rg->rg_vnode);
+        kfree(rg);
+        return result;
+}
@@ -1,46 +1,594 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
 #include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
 
-/* Place your frametable data-structures here 
- * You probably also want to write a frametable initialisation
- * function and call it from vm_bootstrap
+/*
+ * Frame table.
+ *
+ * One entry per physical page of RAM, indexed by frame number
+ * (physical address / PAGE_SIZE). The table itself, and everything
+ * below it that was handed out by ram_stealmem during early boot, is
+ * reserved and never freed.
+ *
+ * Free frames are kept on a doubly-linked list threaded through the
+ * table, so allocating or freeing a single page is O(1). Multi-page
+ * (physically contiguous) allocations, which kmalloc makes for blocks
+ * larger than LARGEST_SUBPAGE_SIZE, are satisfied by a first-fit scan
+ * for a run of free frames; the links let us unhook those frames from
+ * the middle of the free list in O(1) each. The first frame of an
+ * allocated run records its length so free_kpages can give the whole
+ * run back.
+ *
+ * Single frames also carry a reference count, so that user pages can
+ * be shared copy-on-write between address spaces after fork.
+ * alloc_kpages hands out frames with one reference, frame_incref adds
+ * one, and free_kpages drops one; the frame is freed when the last
+ * reference goes away.
+ *
+ * Page replacement. A user frame mapped by exactly one address space
+ * records its owner and virtual address (set by frame_touch from the
+ * fault handler), which makes it a candidate for page-out. When the
+ * free list is empty, a one-page alloc_kpages runs a clock
+ * (second-chance) scan over the table: frames touched since the hand
+ * last passed have their reference bit cleared and are skipped, and
+ * the first unreferenced candidate is paged out by vm_pageout and
+ * handed to the caller. The MIPS has no hardware reference bit, so
+ * frame_touch sets it whenever a translation is loaded into the TLB,
+ * and clearing it also drops the translation so the next access
+ * faults and sets it again.
+ *
+ * Paging out sleeps, so it is only done when the caller could sleep
+ * anyway, and is serialized by ft_pageoutlock. The owner's as_lock is
+ * taken with lock_tryacquire while ft_lock is held (a frame's owner
+ * cannot be destroyed while it still maps the frame, and destroying
+ * it needs ft_lock to free its frames), and frames whose owner is
+ * busy are passed over.
+ *
+ * A modified page of a shared file mapping has to be written to its
+ * file, not swap, and that can't be done from here: the file system
+ * takes vfs_biglock, which the thread allocating may already hold, as
+ * may the page's owner, waiting in a fault for the as_lock we hold.
+ * So the clock passes such a frame over, marking it FE_DIRTY, and
+ * wakes the page cleaner thread. That write-protects the page under
+ * as_lock (taken the same way), takes a reference on the frame, and
+ * writes it out with no locks held; next time round it's clean and
+ * can be dropped.
  */
 
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+#define FE_RESERVED     0       /* kernel image, boot allocations, table */
+#define FE_FREE         1       /* on the free list */
+#define FE_USED         2       /* allocated */
 
-/* Note that this function returns a VIRTUAL address, not a physical 
+#define FE_NONE         (-1)    /* end of free list */
+
+/* fe_flags */
+#define FE_REF          0x1     /* referenced since the clock passed */
+#define FE_BUSY         0x2     /* being paged out */
+#define FE_DIRTY        0x4     /* for the cleaner to write back */
+
+struct frame {
+        int fe_next;            /* free list links (frame numbers) */
+        int fe_prev;
+        unsigned fe_npages;     /* length of run starting here, if used */
+        unsigned fe_refcount;   /* references to a single-page frame */
+        struct addrspace *fe_as;        /* sole user mapping, if any */
+        vaddr_t fe_vaddr;               /* ...and where it's mapped */
+        unsigned char fe_state; /* FE_* */
+        unsigned char fe_flags; /* FE_REF, FE_BUSY, FE_DIRTY */
+};
+
+static struct frame *frametable;        /* NULL until bootstrapped */
+static unsigned ft_nframes;             /* total frames of RAM */
+static unsigned ft_firstframe;          /* first frame we manage */
+static unsigned ft_nfree;               /* frames on the free list */
+static int ft_freehead;                 /* head of the free list */
+static unsigned ft_clockhand;           /* next frame the clock looks at */
+static struct lock *ft_pageoutlock;     /* serializes page-out */
+static struct wchan *ft_cleanwchan;     /* the cleaner waits here */
+static bool ft_cleanwanted;             /* frames marked FE_DIRTY */
+
+static void ft_cleanthread(void *, unsigned long);
+
+/*
+ * Protects the frame table; before it exists, protects ram_stealmem.
+ */
+static struct spinlock ft_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Free list operations. Call with ft_lock held.
+ */
+static
+void
+ft_push(unsigned f)
+{
+        struct frame *fe = &frametable[f];
+
+        fe->fe_state = FE_FREE;
+        fe->fe_npages = 0;
+        fe->fe_refcount = 0;
+        fe->fe_as = NULL;
+        fe->fe_flags = 0;
+        fe->fe_prev = FE_NONE;
+        fe->fe_next = ft_freehead;
+        if (ft_freehead != FE_NONE) {
+                frametable[ft_freehead].fe_prev = f;
+        }
+        ft_freehead = f;
+        ft_nfree++;
+}
+
+static
+void
+ft_unlink(unsigned f)
+{
+        struct frame *fe = &frametable[f];
+
+        KASSERT(fe->fe_state == FE_FREE);
+        if (fe->fe_prev != FE_NONE) {
+                frametable[fe->fe_prev].fe_next = fe->fe_next;
+        }
+        else {
+                ft_freehead = fe->fe_next;
+        }
+        if (fe->fe_next != FE_NONE) {
+                frametable[fe->fe_next].fe_prev = fe->fe_prev;
+        }
+        fe->fe_state = FE_USED;
+        fe->fe_npages = 0;
+        ft_nfree--;
+}
+
+/*
+ * Find NPAGES consecutive free frames and take them off the free
+ * list. Returns the first frame number, or -1 if there's no such run.
+ * Call with ft_lock held.
+ */
+static
+int
+ft_takerun(unsigned npages)
+{
+        unsigned start, len, f;
+
+        len = 0;
+        for (f = ft_firstframe; f < ft_nframes; f++) {
+                if (frametable[f].fe_state != FE_FREE) {
+                        len = 0;
+                        continue;
+                }
+                if (++len == npages) {
+                        start = f + 1 - npages;
+                        for (f = start; f < start + npages; f++) {
+                                ft_unlink(f);
+                        }
+                        return start;
+                }
+        }
+        return -1;
+}
+
+/*
+ * Set up the frame table. Called from vm_bootstrap; after this,
+ * ram_stealmem must not be used.
+ */
+void
+frametable_bootstrap(void)
+{
+        paddr_t tablepaddr, firstfree;
+        size_t tablesize;
+        struct frame *ft;
+        unsigned f;
+        int result;
+
+        ft_nframes = ram_getsize() / PAGE_SIZE;
+        tablesize = ft_nframes * sizeof(struct frame);
+
+        spinlock_acquire(&ft_lock);
+
+        tablepaddr = ram_stealmem(DIVROUNDUP(tablesize, PAGE_SIZE));
+        if (tablepaddr == 0) {
+                panic("frametable: cannot allocate %u bytes\n",
+                      (unsigned)tablesize);
+        }
+        firstfree = ram_getfirstfree();
+
+        ft = (struct frame *)PADDR_TO_KVADDR(tablepaddr);
+        for (f = 0; f < ft_nframes; f++) {
+                ft[f].fe_next = ft[f].fe_prev = FE_NONE;
+                ft[f].fe_npages = 0;
+                ft[f].fe_refcount = 0;
+                ft[f].fe_as = NULL;
+                ft[f].fe_vaddr = 0;
+                ft[f].fe_state = FE_RESERVED;
+                ft[f].fe_flags = 0;
+        }
+        frametable = ft;
+
+        ft_firstframe = firstfree / PAGE_SIZE;
+        ft_clockhand = ft_firstframe;
+        ft_freehead = FE_NONE;
+        ft_nfree = 0;
+        /* Push in reverse so the free list hands out low frames first. */
+        for (f = ft_nframes; f-- > ft_firstframe; ) {
+                ft_push(f);
+        }
+
+        spinlock_release(&ft_lock);
+
+        ft_pageoutlock = lock_create("pageout");
+        if (ft_pageoutlock == NULL) {
+                panic("frametable: cannot create pageout lock\n");
+        }
+        ft_cleanwchan = wchan_create("pageclean");
+        if (ft_cleanwchan == NULL) {
+                panic("frametable: cannot create cleaner wchan\n");
+        }
+        result = thread_fork("pageclean", NULL, ft_cleanthread, NULL, 0);
+        if (result) {
+                panic("frametable: thread_fork: %s\n", strerror(result));
+        }
+
+        kprintf("vm: %u of %u frames free\n", ft_nfree, ft_nframes);
+}
+
+/*
+ * Whether alloc_kpages may page something out to satisfy a request:
+ * only if the caller could sleep, and isn't already paging out (the
+ * I/O path may allocate memory).
+ */
+static
+bool
+ft_canevict(void)
+{
+        return ft_pageoutlock != NULL &&
+                curthread->t_curspl == 0 &&
+                !curthread->t_in_interrupt &&
+                !lock_do_i_hold(ft_pageoutlock);
+}
+
+/*
+ * Run the replacement clock to free up one frame, which is returned
+ * already allocated (one page, one reference). Returns FE_NONE if
+ * nothing could be paged out.
+ */
+static
+int
+ft_evict(void)
+{
+        struct frame *fe;
+        struct addrspace *as;
+        vaddr_t va;
+        unsigned f, scanned;
+        bool locked;
+        int result;
+
+        lock_acquire(ft_pageoutlock);
+        spinlock_acquire(&ft_lock);
+
+        /* Two sweeps: one to clear reference bits, one to find a victim. */
+        for (scanned = 0; scanned < 2 * (ft_nframes - ft_firstframe); scanned++) {
+                f = ft_clockhand;
+                ft_clockhand = (f + 1 < ft_nframes) ? f + 1 : ft_firstframe;
+                fe = &frametable[f];
+
+                if (fe->fe_state != FE_USED || fe->fe_as == NULL ||
+                    fe->fe_refcount != 1 || (fe->fe_flags & FE_BUSY)) {
+                        continue;
+                }
+                if (fe->fe_flags & FE_REF) {
+                        /*
+                         * Second chance. Only this CPU's TLB is
+                         * checked (we hold ft_lock, so no
+                         * shootdown): if another CPU keeps using
+                         * the page through a cached entry, it just
+                         * looks idle, and vm_pageout shoots it down
+                         * properly.
+                         */
+                        fe->fe_flags &= ~FE_REF;
+                        vm_tlbinvalidate(fe->fe_as, fe->fe_vaddr);
+                        continue;
+                }
+
+                as = fe->fe_as;
+                va = fe->fe_vaddr;
+                if (lock_do_i_hold(as->as_lock)) {
+                        locked = false;
+                }
+                else if (lock_tryacquire(as->as_lock)) {
+                        locked = true;
+                }
+                else {
+                        continue;
+                }
+                fe->fe_flags |= FE_BUSY;
+                spinlock_release(&ft_lock);
+
+                result = vm_pageout(as, va, (paddr_t)f * PAGE_SIZE);
+                if (locked) {
+                        lock_release(as->as_lock);
+                }
+
+                spinlock_acquire(&ft_lock);
+                fe->fe_flags &= ~FE_BUSY;
+                if (result == EBUSY) {
+                        fe->fe_flags |= FE_DIRTY;
+                        ft_cleanwanted = true;
+                        wchan_wakeone(ft_cleanwchan, &ft_lock);
+                        continue;
+                }
+                if (result == 0) {
+                        KASSERT(fe->fe_refcount == 1);
+                        fe->fe_as = NULL;
+                        fe->fe_flags = 0;
+                        spinlock_release(&ft_lock);
+                        lock_release(ft_pageoutlock);
+                        return f;
+                }
+                /* Couldn't page it out (no swap?); try another. */
+        }
+
+        spinlock_release(&ft_lock);
+        lock_release(ft_pageoutlock);
+        return FE_NONE;
+}
+
+/*
+ * The page cleaner. See the top of the file.
+ */
+static
+void
+ft_cleanthread(void *junk1, unsigned long junk2)
+{
+        struct frame *fe;
+        struct addrspace *as;
+        struct vnode *vn;
+        vaddr_t va, kva;
+        off_t pos;
+        unsigned f;
+        int result;
+
+        (void)junk1;
+        (void)junk2;
+
+        spinlock_acquire(&ft_lock);
+        while (1) {
+                while (!ft_cleanwanted) {
+                        wchan_sleep(ft_cleanwchan, &ft_lock);
+                }
+                ft_cleanwanted = false;
+
+                for (f = ft_firstframe; f < ft_nframes; f++) {
+                        fe = &frametable[f];
+                        if (!(fe->fe_flags & FE_DIRTY)) {
+                                continue;
+                        }
+                        fe->fe_flags &= ~FE_DIRTY;
+                        if (fe->fe_state != FE_USED || fe->fe_as == NULL ||
+                            fe->fe_refcount != 1 ||
+                            (fe->fe_flags & FE_BUSY)) {
+                                continue;
+                        }
+                        as = fe->fe_as;
+                        va = fe->fe_vaddr;
+                        if (!lock_tryacquire(as->as_lock)) {
+                                /* The clock will mark it again. */
+                                continue;
+                        }
+                        fe->fe_flags |= FE_BUSY;
+                        spinlock_release(&ft_lock);
+
+                        result = vm_cleanprep(as, va, (paddr_t)f * PAGE_SIZE,
+                                              &vn, &pos);
+
+                        spinlock_acquire(&ft_lock);
+                        fe->fe_flags &= ~FE_BUSY;
+                        if (result == 0) {
+                                /* Keep the frame until it's written. */
+                                fe->fe_refcount++;
+                        }
+                        spinlock_release(&ft_lock);
+                        lock_release(as->as_lock);
+
+                        if (result == 0) {
+                                kva = PADDR_TO_KVADDR((paddr_t)f * PAGE_SIZE);
+                                result = vm_writefile(vn, pos, kva);
+                                if (result) {
+                                        kprintf("vm: writing back a mapped "
+                                                "page: %s\n",
+                                                strerror(result));
+                                }
+                                VOP_DECREF(vn);
+                                free_kpages(kva);
+                        }
+                        spinlock_acquire(&ft_lock);
+                }
+        }
+}
+
+/*
+ * Take NPAGES free frames off the free list and give them one
+ * reference. Returns FE_NONE if there aren't any. Call with ft_lock.
+ */
+static
+int
+ft_take(unsigned npages)
+{
+        int f;
+
+        if (npages == 1) {
+                f = ft_freehead;
+                if (f != FE_NONE) {
+                        ft_unlink(f);
+                }
+        }
+        else {
+                f = ft_takerun(npages);
+        }
+        if (f != FE_NONE) {
+                frametable[f].fe_npages = npages;
+                frametable[f].fe_refcount = 1;
+        }
+        return f;
+}
+
+/* Note that this function returns a VIRTUAL address, not a physical
  * address
  * WARNING: this function gets called very early, before
- * vm_bootstrap().  You may wish to modify main.c to call your
- * frame table initialisation function, or check to see if the
- * frame table has been initialised and call ram_stealmem() otherwise.
+ * vm_bootstrap(). Until the frame table exists it falls back to
+ * ram_stealmem, and those pages are never reclaimed.
+ *
+ * If memory is short, the threads kept for reuse are freed first, and
+ * kmalloc's per-CPU magazines emptied; then, if the caller can
+ * sleep, a one-page request pages out a user page to make room.
  */
 
 vaddr_t alloc_kpages(unsigned int npages)
 {
-        /*
-         * IMPLEMENT ME.  You should replace this code with a proper
-         *                implementation.
-         */
-
         paddr_t addr;
+        int f;
+
+        if (npages == 0) {
+                return 0;
+        }
 
-        spinlock_acquire(&stealmem_lock);
-        addr = ram_stealmem(npages);
-        spinlock_release(&stealmem_lock);
+        spinlock_acquire(&ft_lock);
+        if (frametable == NULL) {
+                addr = ram_stealmem(npages);
+                spinlock_release(&ft_lock);
+                if (addr == 0) {
+                        return 0;
+                }
+                return PADDR_TO_KVADDR(addr);
+        }
 
-        if(addr == 0)
+        f = ft_take(npages);
+        spinlock_release(&ft_lock);
+
+        if (f == FE_NONE && thread_pool_reclaim() > 0) {
+                /* Freed some cached thread stacks; try again. */
+                spinlock_acquire(&ft_lock);
+                f = ft_take(npages);
+                spinlock_release(&ft_lock);
+        }
+        if (f == FE_NONE && kheap_drain() > 0) {
+                /* Freed some kmalloc pages held by its magazines. */
+                spinlock_acquire(&ft_lock);
+                f = ft_take(npages);
+                spinlock_release(&ft_lock);
+        }
+        if (f == FE_NONE && npages == 1 && ft_canevict()) {
+                f = ft_evict();
+        }
+        if (f == FE_NONE) {
                 return 0;
+        }
 
+        addr = (paddr_t)f * PAGE_SIZE;
         return PADDR_TO_KVADDR(addr);
 }
 
 void free_kpages(vaddr_t addr)
 {
-        (void) addr;
+        unsigned f, i, npages;
+
+        KASSERT(addr % PAGE_SIZE == 0);
+        f = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+
+        spinlock_acquire(&ft_lock);
+        if (frametable == NULL || f < ft_firstframe) {
+                /* Stolen before the frame table existed; leak it. */
+                spinlock_release(&ft_lock);
+                return;
+        }
+        KASSERT(f < ft_nframes);
+        KASSERT(frametable[f].fe_state == FE_USED);
+        KASSERT(frametable[f].fe_refcount > 0);
+        if (--frametable[f].fe_refcount > 0) {
+                /* Still shared. */
+                spinlock_release(&ft_lock);
+                return;
+        }
+        npages = frametable[f].fe_npages;
+        KASSERT(npages > 0 && f + npages <= ft_nframes);
+        for (i = 0; i < npages; i++) {
+                KASSERT(frametable[f + i].fe_state == FE_USED);
+                ft_push(f + i);
+        }
+        spinlock_release(&ft_lock);
 }
 
+/*
+ * Add a reference to the (single-page) frame at physical address PA.
+ */
+void
+frame_incref(paddr_t pa)
+{
+        unsigned f = pa / PAGE_SIZE;
+
+        spinlock_acquire(&ft_lock);
+        KASSERT(f >= ft_firstframe && f < ft_nframes);
+        KASSERT(frametable[f].fe_state == FE_USED);
+        KASSERT(frametable[f].fe_npages == 1);
+        KASSERT(frametable[f].fe_refcount > 0);
+        frametable[f].fe_refcount++;
+        /* Shared frames have no single owner and aren't paged out. */
+        frametable[f].fe_as = NULL;
+        spinlock_release(&ft_lock);
+}
+
+/*
+ * Return the number of references to the frame at PA. The answer may
+ * be stale by the time it is used, except that if the caller holds
+ * the only reference nobody else can add one.
+ */
+unsigned
+frame_refcount(paddr_t pa)
+{
+        unsigned f = pa / PAGE_SIZE;
+        unsigned ret;
+
+        spinlock_acquire(&ft_lock);
+        KASSERT(f >= ft_firstframe && f < ft_nframes);
+        KASSERT(frametable[f].fe_state == FE_USED);
+        ret = frametable[f].fe_refcount;
+        spinlock_release(&ft_lock);
+        return ret;
+}
+
+/*
+ * Return the number of free frames. Only a snapshot, for sizing
+ * things at boot.
+ */
+unsigned
+frame_freecount(void)
+{
+        unsigned ret;
+
+        spinlock_acquire(&ft_lock);
+        ret = ft_nfree;
+        spinlock_release(&ft_lock);
+        return ret;
+}
+
+void
+frame_touch(paddr_t pa, struct addrspace *as, vaddr_t va)
+{
+        struct frame *fe = &frametable[pa / PAGE_SIZE];
+
+        spinlock_acquire(&ft_lock);
+        KASSERT(fe->fe_state == FE_USED);
+        fe->fe_flags |= FE_REF;
+        if (fe->fe_refcount == 1) {
+                fe->fe_as = as;
+                fe->fe_vaddr = va;
+        }
+        spinlock_release(&ft_lock);
+}
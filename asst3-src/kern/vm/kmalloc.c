@@ -30,7 +30,10 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -160,10 +163,9 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole thing. The per-cpu magazines (see
+ * below) keep most allocations and frees from needing it. It comes
+ * after the magazines' own locks.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -345,6 +347,46 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * The pageref for each subpage heap page, indexed by physical page
+ * number, so kfree can find it without searching allbase. Entries are
+ * set under kmalloc_spinlock when a page joins the heap and cleared
+ * when it leaves. A page can't leave while any of its blocks is
+ * allocated, so the entry for the page of an allocated block may be
+ * read without the lock. Pages past the end of the table (if there
+ * is more RAM than the pageref pages can cover anyway) aren't in it.
+ */
+static struct pageref *pagerefs_bypage[TOTAL_PAGEREFS];
+
+/*
+ * Index into pagerefs_bypage for the page containing ADDR, or
+ * TOTAL_PAGEREFS if it isn't covered.
+ */
+static
+unsigned
+pagerefindex(vaddr_t addr)
+{
+	unsigned n;
+
+	if (addr < MIPS_KSEG0 || addr >= MIPS_KSEG1) {
+		return TOTAL_PAGEREFS;
+	}
+	n = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	return n < TOTAL_PAGEREFS ? n : TOTAL_PAGEREFS;
+}
+
+static
+void
+setpageref(vaddr_t prpage, struct pageref *pr)
+{
+	unsigned n;
+
+	n = pagerefindex(prpage);
+	if (n < TOTAL_PAGEREFS) {
+		pagerefs_bypage[n] = pr;
+	}
+}
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -866,6 +908,42 @@ int blocktype(size_t clientsz)
 	return 0;
 }
 
+/*
+ * Take a block off the free list of page PR, which must have one.
+ * Call with kmalloc_spinlock held.
+ */
+static
+void *
+subpage_popblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
 /*
  * Allocate a block of size SZ, where SZ is not large enough to
  * warrant a whole-page allocation.
@@ -921,25 +999,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_popblock(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -1013,10 +1073,72 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+	setpageref(prpage, pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Put the block at OFFSET in page PR back on the page's free list.
+ * If that makes the whole page free, take the page out of the heap
+ * and return its address, which the caller should pass to free_kpages
+ * once kmalloc_spinlock is released; otherwise return 0.
+ *
+ * Call with kmalloc_spinlock held.
+ */
+static
+vaddr_t
+subpage_pushblock(struct pageref *pr, vaddr_t offset)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		setpageref(prpage, NULL);
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
+
 /*
  * Free a pointer previously returned from subpage_kmalloc. If the
  * pointer is not on any heap page we recognize, return -1.
@@ -1029,9 +1151,9 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	vaddr_t freepage;	// page to hand back to free_kpages
+	unsigned n;		// index into pagerefs_bypage
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
@@ -1065,21 +1187,23 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
+	n = pagerefindex(ptraddr);
+	if (n < TOTAL_PAGEREFS) {
+		pr = pagerefs_bypage[n];
+	}
+	else {
+		/* Not in the table; search for it. */
+		for (pr = allbase; pr; pr = pr->next_all) {
+			prpage = PR_PAGEADDR(pr);
+			blktype = PR_BLOCKTYPE(pr);
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+			/* check for corruption */
+			KASSERT(blktype>=0 && blktype<NSIZES);
+			checksubpage(pr);
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+			if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+				break;
+			}
 		}
 	}
 
@@ -1089,6 +1213,9 @@ subpage_kfree(void *ptr)
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype >= 0 && blktype < NSIZES);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1108,57 +1235,263 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	freepage = subpage_pushblock(pr, offset);
+	spinlock_release(&kmalloc_spinlock);
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	if (freepage != 0) {
+		/* Call free_kpages without kmalloc_spinlock. */
+		free_kpages(freepage);
+	}
 
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
+#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+#endif
 
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
+	return 0;
+}
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+// Each CPU keeps, for each block size, a small stack ("magazine") of
+// free blocks. kmalloc pops from it and kfree pushes onto it holding
+// only that CPU's mc_lock, which nobody else takes except to drain
+// it, so it is never contended in the normal course of things. Only
+// when the magazine is empty or full is kmalloc_spinlock taken (after
+// mc_lock), to move MAG_BATCH blocks at a time between the magazine
+// and the pages' free lists. As far as its page is concerned a block
+// in a magazine is still allocated, so the page can't be freed out
+// from under it.
+//
+// That also means the blocks in magazines can keep pages that are
+// otherwise free from going back to the page allocator, so when it
+// runs out it calls kheap_drain to empty all of them first.
+//
+// GUARDS and LABELS decorate each block on the way through
+// subpage_kmalloc and subpage_kfree, so with those the magazines are
+// left out.
+//
+
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
 #endif
+
+#ifdef MAGAZINES
+
+#define MAG_ROUNDS	16	/* blocks a magazine can hold */
+#define MAG_BATCH	8	/* blocks moved per trip to the free lists */
+
+struct magazine {
+	unsigned mg_count;
+	void *mg_rounds[MAG_ROUNDS];
+};
+
+struct magcpu {
+	struct spinlock mc_lock;
+	struct magazine mc_mags[NSIZES];
+};
+
+static struct magcpu magcpus[MAXCPUS] = {
+	[0 ... MAXCPUS - 1] = { .mc_lock = SPINLOCK_INITIALIZER },
+};
+
+/*
+ * Lock and return this CPU's magazines. If we move to another CPU
+ * before the lock is taken that's fine; they're just as good.
+ */
+static
+struct magcpu *
+mag_lockmine(void)
+{
+	struct magcpu *mc;
+
+	mc = &magcpus[curcpu->c_number];
+	spinlock_acquire(&mc->mc_lock);
+	return mc;
+}
+
+/*
+ * Send the last N blocks in MG back to their pages, and put the
+ * addresses of any pages that become wholly free in FREEPAGES.
+ * Returns how many of those there are. Call with kmalloc_spinlock.
+ */
+static
+unsigned
+mag_unload(struct magazine *mg, unsigned n, vaddr_t *freepages)
+{
+	struct pageref *pr;
+	vaddr_t ptraddr, prpage;
+	unsigned i, nfreepages = 0;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(n <= mg->mg_count);
+
+	for (i=0; i<n; i++) {
+		ptraddr = (vaddr_t)mg->mg_rounds[--mg->mg_count];
+		pr = pagerefs_bypage[pagerefindex(ptraddr)];
+		KASSERT(pr != NULL);
+		prpage = subpage_pushblock(pr, ptraddr - PR_PAGEADDR(pr));
+		if (prpage != 0) {
+			freepages[nfreepages++] = prpage;
+		}
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+	return nfreepages;
+}
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
+/*
+ * Get a block of type BLKTYPE from this CPU's magazine, refilling it
+ * from the free lists if it is empty. Returns NULL if there's no CPU
+ * yet or no free block on any existing page, in which case the caller
+ * should go to subpage_kmalloc for a new page.
+ */
+static
+void *
+mag_alloc(unsigned blktype)
+{
+	struct magcpu *mc;
+	struct magazine *mg;
+	struct pageref *pr;
+	void *ret;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	mc = mag_lockmine();
+	mg = &mc->mc_mags[blktype];
+
+	if (mg->mg_count == 0) {
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		for (pr = sizebases[blktype];
+		     pr != NULL && mg->mg_count < MAG_BATCH;
+		     pr = pr->next_samesize) {
+			KASSERT(PR_BLOCKTYPE(pr) == blktype);
+			while (pr->nfree > 0 && mg->mg_count < MAG_BATCH) {
+				mg->mg_rounds[mg->mg_count++] =
+					subpage_popblock(pr);
+			}
+		}
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
 	}
-	else {
+
+	ret = NULL;
+	if (mg->mg_count > 0) {
+		ret = mg->mg_rounds[--mg->mg_count];
+	}
+	spinlock_release(&mc->mc_lock);
+	return ret;
+}
+
+/*
+ * Put PTR, if it is a subpage block, in this CPU's magazine. If the
+ * magazine is full, first send MAG_BATCH blocks back to their pages.
+ * Returns -1 (and does nothing) if PTR isn't a block we can find
+ * without the lock, or there's no CPU yet; the caller should then use
+ * subpage_kfree.
+ */
+static
+int
+mag_free(void *ptr)
+{
+	struct magcpu *mc;
+	struct magazine *mg;
+	struct pageref *pr;
+	vaddr_t ptraddr, prpage, offset;
+	vaddr_t freepages[MAG_BATCH];
+	unsigned blktype, n, i, nfreepages;
+
+	ptraddr = (vaddr_t)ptr;
+	n = pagerefindex(ptraddr);
+	if (n == TOTAL_PAGEREFS || !CURCPU_EXISTS()) {
+		return -1;
+	}
+
+	/*
+	 * No lock needed: the block is allocated, so its page can't
+	 * join or leave the heap while we look.
+	 */
+	pr = pagerefs_bypage[n];
+	if (pr == NULL) {
+		return -1;
+	}
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
+	offset = ptraddr - prpage;
+	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	nfreepages = 0;
+	mc = mag_lockmine();
+	mg = &mc->mc_mags[blktype];
+
+	if (mg->mg_count == MAG_ROUNDS) {
+		spinlock_acquire(&kmalloc_spinlock);
+		nfreepages = mag_unload(mg, MAG_BATCH, freepages);
+		checksubpages();
 		spinlock_release(&kmalloc_spinlock);
 	}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
+	mg->mg_rounds[mg->mg_count++] = ptr;
+	spinlock_release(&mc->mc_lock);
 
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
 	return 0;
 }
 
+#endif /* MAGAZINES */
+
+/*
+ * Empty every CPU's magazines back onto the free lists, and give the
+ * pages that leaves wholly free back to the page allocator. Returns
+ * the number of pages given back. Called by alloc_kpages when it runs
+ * out, so must not be called holding kmalloc_spinlock or an mc_lock.
+ */
+unsigned
+kheap_drain(void)
+{
+	unsigned total = 0;
+#ifdef MAGAZINES
+	struct magcpu *mc;
+	vaddr_t freepages[MAG_ROUNDS];
+	unsigned cpu, blktype, i, nfreepages;
+
+	for (cpu=0; cpu<MAXCPUS; cpu++) {
+		mc = &magcpus[cpu];
+		for (blktype=0; blktype<NSIZES; blktype++) {
+			spinlock_acquire(&mc->mc_lock);
+			spinlock_acquire(&kmalloc_spinlock);
+			nfreepages = mag_unload(&mc->mc_mags[blktype],
+						mc->mc_mags[blktype].mg_count,
+						freepages);
+			checksubpages();
+			spinlock_release(&kmalloc_spinlock);
+			spinlock_release(&mc->mc_lock);
+
+			for (i=0; i<nfreepages; i++) {
+				free_kpages(freepages[i]);
+			}
+			total += nfreepages;
+		}
+	}
+#endif
+	return total;
+}
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1198,6 +1531,17 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#ifdef MAGAZINES
+	{
+		void *ptr;
+
+		ptr = mag_alloc(blocktype(sz));
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+#endif
+
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
@@ -1216,7 +1560,13 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	if (mag_free(ptr) == 0) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
@@ -0,0 +1,286 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem.h>
+
+/*
+ * Object caches. See kmem.h for the interface.
+ *
+ * A slab is one page: a struct kmem_slab at the start, then a stack
+ * of the indexes of the free objects, then (at the end of the page)
+ * the objects themselves. The object storage is never written by the
+ * cache, so free objects keep whatever their constructor put there.
+ * An object's slab is found by masking off the page offset.
+ *
+ * Each cache keeps its partly used slabs on one list and its wholly
+ * free ones on another; full slabs are on no list. Objects come from
+ * a partly used slab if there is one, so that the free slabs stay
+ * free and can be given back. Slabs are made (and their objects
+ * constructed) only when both lists are empty. Up to KMEM_EMPTYSLABS
+ * wholly free slabs are kept for reuse; past that a slab that becomes
+ * free has its objects destroyed and its page returned.
+ *
+ * The constructors and destructors are called without the cache's
+ * spinlock, so they may allocate memory, create locks, and so on.
+ */
+
+#define KMEM_EMPTYSLABS		1	/* wholly free slabs kept per cache */
+#define KMEM_ALIGN		8	/* object alignment */
+
+struct kmem_slab {
+	struct kmem_cache *sl_cache;
+	struct kmem_slab *sl_next;	/* on kc_slabs or kc_empty */
+	struct kmem_slab *sl_prev;
+	unsigned sl_nfree;		/* entries in sl_free */
+	uint16_t sl_free[];		/* indexes of free objects */
+};
+
+#define KMEM_OBJSIZE(kc)	ROUNDUP((kc)->kc_size, KMEM_ALIGN)
+#define KMEM_SLAB(obj)		((struct kmem_slab *)((vaddr_t)(obj) & PAGE_FRAME))
+
+/*
+ * Address of object number IX of slab SL.
+ */
+static
+void *
+kmem_slab_obj(struct kmem_cache *kc, struct kmem_slab *sl, unsigned ix)
+{
+	size_t objsize = KMEM_OBJSIZE(kc);
+	vaddr_t base;
+
+	base = (vaddr_t)sl + PAGE_SIZE - kc->kc_perslab * objsize;
+	return (void *)(base + ix * objsize);
+}
+
+/*
+ * Number of object OBJ within its slab SL.
+ */
+static
+unsigned
+kmem_slab_index(struct kmem_cache *kc, struct kmem_slab *sl, void *obj)
+{
+	size_t objsize = KMEM_OBJSIZE(kc);
+	vaddr_t base;
+	unsigned ix;
+
+	base = (vaddr_t)sl + PAGE_SIZE - kc->kc_perslab * objsize;
+	KASSERT((vaddr_t)obj >= base);
+	ix = ((vaddr_t)obj - base) / objsize;
+	if (ix >= kc->kc_perslab || (vaddr_t)obj != base + ix * objsize) {
+		panic("kmem_cache_free: %s: invalid object %p\n",
+		      kc->kc_name, obj);
+	}
+	return ix;
+}
+
+/*
+ * Work out how many objects fit in a slab.
+ */
+static
+void
+kmem_cache_setup(struct kmem_cache *kc)
+{
+	size_t objsize = KMEM_OBJSIZE(kc);
+	unsigned n;
+
+	n = (PAGE_SIZE - sizeof(struct kmem_slab)) /
+		(objsize + sizeof(uint16_t));
+	if (n < 2) {
+		panic("kmem: %s: objects of size %zu are too big\n",
+		      kc->kc_name, kc->kc_size);
+	}
+	/* Several CPUs may get here at once; they all get the same answer. */
+	kc->kc_perslab = n;
+}
+
+/*
+ * Run the destructor on the first N objects of SL.
+ */
+static
+void
+kmem_slab_dtor(struct kmem_cache *kc, struct kmem_slab *sl, unsigned n)
+{
+	unsigned i;
+
+	if (kc->kc_dtor == NULL) {
+		return;
+	}
+	for (i=0; i<n; i++) {
+		kc->kc_dtor(kmem_slab_obj(kc, sl, i));
+	}
+}
+
+/*
+ * Make a new slab with all its objects constructed and free.
+ * Called without kc_lock.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *sl;
+	vaddr_t page;
+	unsigned i;
+	int result;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	sl = (struct kmem_slab *)page;
+	sl->sl_cache = kc;
+	sl->sl_next = sl->sl_prev = NULL;
+	sl->sl_nfree = 0;
+
+	for (i=0; i<kc->kc_perslab; i++) {
+		if (kc->kc_ctor != NULL) {
+			result = kc->kc_ctor(kmem_slab_obj(kc, sl, i));
+			if (result) {
+				kmem_slab_dtor(kc, sl, i);
+				free_kpages(page);
+				return NULL;
+			}
+		}
+	}
+
+	/* Stack them so objects are handed out in address order. */
+	for (i=kc->kc_perslab; i-- > 0; ) {
+		sl->sl_free[sl->sl_nfree++] = i;
+	}
+	return sl;
+}
+
+/*
+ * Destroy all the objects of SL, which must be wholly free and on no
+ * list, and give back its page. Called without kc_lock.
+ */
+static
+void
+kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *sl)
+{
+	KASSERT(sl->sl_nfree == kc->kc_perslab);
+	kmem_slab_dtor(kc, sl, kc->kc_perslab);
+	sl->sl_cache = NULL;
+	free_kpages((vaddr_t)sl);
+}
+
+/*
+ * Put SL at the head of the list *LIST (kc_slabs or kc_empty). Call
+ * with kc_lock held.
+ */
+static
+void
+kmem_slab_link(struct kmem_slab **list, struct kmem_slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = *list;
+	if (*list != NULL) {
+		(*list)->sl_prev = sl;
+	}
+	*list = sl;
+}
+
+/*
+ * Take SL off the list *LIST. Call with kc_lock held.
+ */
+static
+void
+kmem_slab_unlink(struct kmem_slab **list, struct kmem_slab *sl)
+{
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		KASSERT(*list == sl);
+		*list = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+/*
+ * Get a constructed object from KC.
+ */
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *sl;
+	void *obj;
+
+	if (kc->kc_perslab == 0) {
+		kmem_cache_setup(kc);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	sl = kc->kc_slabs;
+	if (sl == NULL) {
+		/* No partly used slab; start on a free one. */
+		sl = kc->kc_empty;
+		if (sl != NULL) {
+			kmem_slab_unlink(&kc->kc_empty, sl);
+			KASSERT(kc->kc_nemptyslabs > 0);
+			kc->kc_nemptyslabs--;
+		}
+		else {
+			spinlock_release(&kc->kc_lock);
+			sl = kmem_slab_create(kc);
+			if (sl == NULL) {
+				return NULL;
+			}
+			spinlock_acquire(&kc->kc_lock);
+		}
+		KASSERT(sl->sl_nfree == kc->kc_perslab);
+		kmem_slab_link(&kc->kc_slabs, sl);
+	}
+
+	KASSERT(sl->sl_nfree > 0);
+	obj = kmem_slab_obj(kc, sl, sl->sl_free[--sl->sl_nfree]);
+	if (sl->sl_nfree == 0) {
+		kmem_slab_unlink(&kc->kc_slabs, sl);
+	}
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+/*
+ * Give OBJ, which must be in its constructed state, back to KC.
+ */
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *sl;
+	unsigned ix;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	sl = KMEM_SLAB(obj);
+	KASSERT(sl->sl_cache == kc);
+	ix = kmem_slab_index(kc, sl, obj);
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(sl->sl_nfree < kc->kc_perslab);
+	if (sl->sl_nfree == 0) {
+		kmem_slab_link(&kc->kc_slabs, sl);
+	}
+	sl->sl_free[sl->sl_nfree++] = ix;
+
+	if (sl->sl_nfree == kc->kc_perslab) {
+		kmem_slab_unlink(&kc->kc_slabs, sl);
+		if (kc->kc_nemptyslabs < KMEM_EMPTYSLABS) {
+			kmem_slab_link(&kc->kc_empty, sl);
+			kc->kc_nemptyslabs++;
+		}
+		else {
+			spinlock_release(&kc->kc_lock);
+			kmem_slab_destroy(kc, sl);
+			return;
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+}
@@ -0,0 +1,131 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+
+/*
+ * Swap space.
+ *
+ * At boot we try to claim SWAP_DEVICE with vfs_swapon and carve it
+ * into page-sized slots, tracked in a bitmap. If there is no such
+ * device the system runs without swap, and only clean pages (which
+ * can be read back from their file) can be paged out.
+ */
+
+#define SWAP_DEVICE     "lhd0"
+
+static struct vnode *swap_vnode;        /* NULL if no swap */
+static struct bitmap *swap_map;         /* slots in use are marked */
+static struct lock *swap_lock;          /* protects swap_map */
+static unsigned swap_nslots;
+
+void
+swap_bootstrap(void)
+{
+        struct stat st;
+        int result;
+
+        result = vfs_swapon(SWAP_DEVICE, &swap_vnode);
+        if (result) {
+                kprintf("vm: no swap on %s: %s\n", SWAP_DEVICE,
+                        strerror(result));
+                swap_vnode = NULL;
+                return;
+        }
+
+        result = VOP_STAT(swap_vnode, &st);
+        if (result) {
+                panic("vm: stat of swap device failed: %s\n",
+                      strerror(result));
+        }
+        swap_nslots = st.st_size / PAGE_SIZE;
+
+        swap_map = bitmap_create(swap_nslots);
+        swap_lock = lock_create("swap");
+        if (swap_map == NULL || swap_lock == NULL) {
+                panic("vm: cannot set up swap\n");
+        }
+
+        kprintf("vm: %u pages of swap on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+/*
+ * Transfer one page between the frame at KVA and swap slot SLOT.
+ */
+static
+int
+swap_io(unsigned slot, vaddr_t kva, enum uio_rw rw)
+{
+        struct iovec iov;
+        struct uio ku;
+        int result;
+
+        KASSERT(slot < swap_nslots);
+
+        uio_kinit(&iov, &ku, (void *)kva, PAGE_SIZE,
+                  (off_t)slot * PAGE_SIZE, rw);
+        if (rw == UIO_READ) {
+                result = VOP_READ(swap_vnode, &ku);
+        }
+        else {
+                result = VOP_WRITE(swap_vnode, &ku);
+        }
+        if (result == 0 && ku.uio_resid != 0) {
+                result = EIO;
+        }
+        return result;
+}
+
+/*
+ * Write the page at KVA to a newly allocated slot, returned in SLOT.
+ */
+int
+swap_out(vaddr_t kva, unsigned *slot)
+{
+        int result;
+
+        if (swap_vnode == NULL) {
+                return ENOSPC;
+        }
+
+        lock_acquire(swap_lock);
+        result = bitmap_alloc(swap_map, slot);
+        lock_release(swap_lock);
+        if (result) {
+                return result;
+        }
+
+        result = swap_io(*slot, kva, UIO_WRITE);
+        if (result) {
+                swap_free(*slot);
+                return result;
+        }
+        return 0;
+}
+
+/*
+ * Read SLOT into the page at KVA. The slot stays allocated.
+ */
+int
+swap_in(unsigned slot, vaddr_t kva)
+{
+        KASSERT(swap_vnode != NULL);
+        return swap_io(slot, kva, UIO_READ);
+}
+
+void
+swap_free(unsigned slot)
+{
+        KASSERT(swap_vnode != NULL);
+
+        lock_acquire(swap_lock);
+        KASSERT(bitmap_isset(swap_map, slot));
+        bitmap_unmark(swap_map, slot);
+        lock_release(swap_lock);
+}
@@ -1,41 +1,995 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
 #include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <machine/tlb.h>
+#include <platform/maxcpus.h>
 
-/* Place your page table functions here */
+/*
+ * Page table.
+ *
+ * Each address space has a two-level page table. The top 10 bits of
+ * a virtual address index the level-1 table, the next 10 bits index a
+ * level-2 table, and the low 12 bits are the offset within the page.
+ * Level-2 tables are only allocated when a page inside a defined
+ * region is first faulted on, so the cost of the table grows with the
+ * part of the address space actually in use, not with its extent.
+ *
+ * Page table entries have the same layout as TLB EntryLo: the
+ * physical frame, plus the dirty (write-enable) and valid bits. A TLB
+ * miss on a resident page is therefore a lookup and a tlb_random.
+ *
+ * A page that has been paged out has the valid bit clear and
+ * PTE_SWAPPED (a bit the hardware ignores) set, and holds its swap
+ * slot number in place of the frame. Its write bit is kept.
+ *
+ * Pages of a shared file mapping (RG_SHARED) are mapped read-only
+ * until first written; the write fault sets PTE_MODIFIED (another bit
+ * the hardware ignores) along with the write bit, so we know to write
+ * the page back to the file.
+ */
+
+#define PT_NENTRIES             1024
+#define PT_L1_INDEX(va)         ((va) >> 22)
+#define PT_L2_INDEX(va)         (((va) >> 12) & (PT_NENTRIES - 1))
+#define PT_VADDR(l1, l2)        (((vaddr_t)(l1) << 22) | ((vaddr_t)(l2) << 12))
+
+#define PTE_FRAME               TLBLO_PPAGE
+#define PTE_WRITE               TLBLO_DIRTY
+#define PTE_VALID               TLBLO_VALID
+#define PTE_SWAPPED             0x00000001
+#define PTE_MODIFIED            0x00000002
+
+#define PTE_SLOT(pte)           ((pte) >> 12)
+#define PTE_MKSWAPPED(slot)     (((paddr_t)(slot) << 12) | PTE_SWAPPED)
+
+int
+pt_create(struct addrspace *as)
+{
+        unsigned i;
+
+        as->as_pt = kmalloc(PT_NENTRIES * sizeof(paddr_t *));
+        if (as->as_pt == NULL) {
+                return ENOMEM;
+        }
+        for (i=0; i<PT_NENTRIES; i++) {
+                as->as_pt[i] = NULL;
+        }
+        return 0;
+}
 
+void
+pt_destroy(struct addrspace *as)
+{
+        unsigned i, j;
+        paddr_t *l2;
+
+        if (as->as_pt == NULL) {
+                return;
+        }
+        for (i=0; i<PT_NENTRIES; i++) {
+                l2 = as->as_pt[i];
+                if (l2 == NULL) {
+                        continue;
+                }
+                for (j=0; j<PT_NENTRIES; j++) {
+                        if (l2[j] & PTE_VALID) {
+                                free_kpages(PADDR_TO_KVADDR(l2[j] & PTE_FRAME));
+                        }
+                        else if (l2[j] & PTE_SWAPPED) {
+                                swap_free(PTE_SLOT(l2[j]));
+                        }
+                }
+                kfree(l2);
+        }
+        kfree(as->as_pt);
+        as->as_pt = NULL;
+}
 
-void vm_bootstrap(void)
+/*
+ * Find the page table entry for VA. If the level-2 table doesn't
+ * exist yet, allocate it when CREATE is set and return NULL otherwise
+ * (or on allocation failure).
+ */
+static
+paddr_t *
+pt_lookup(struct addrspace *as, vaddr_t va, bool create)
 {
-        /* Initialise VM sub-system.  You probably want to initialise your 
-           frame table here as well.
-        */
+        paddr_t *l2;
+        unsigned i;
+
+        l2 = as->as_pt[PT_L1_INDEX(va)];
+        if (l2 == NULL) {
+                if (!create) {
+                        return NULL;
+                }
+                l2 = kmalloc(PT_NENTRIES * sizeof(paddr_t));
+                if (l2 == NULL) {
+                        return NULL;
+                }
+                for (i=0; i<PT_NENTRIES; i++) {
+                        l2[i] = 0;
+                }
+                as->as_pt[PT_L1_INDEX(va)] = l2;
+        }
+        return &l2[PT_L2_INDEX(va)];
 }
 
+/*
+ * Give NEW a private copy of OLD's paged-out page PTE, read straight
+ * from swap into a new frame.
+ */
+static
 int
-vm_fault(int faulttype, vaddr_t faultaddress)
+pt_copyswapped(struct addrspace *new, vaddr_t va, paddr_t oldpte,
+               paddr_t *newpte)
 {
-        (void) faulttype;
-        (void) faultaddress;
+        vaddr_t kva;
+        int result;
 
-        panic("vm_fault hasn't been written yet\n");
+        kva = alloc_kpages(1);
+        if (kva == 0) {
+                return ENOMEM;
+        }
+        result = swap_in(PTE_SLOT(oldpte), kva);
+        if (result) {
+                free_kpages(kva);
+                return result;
+        }
+        *newpte = KVADDR_TO_PADDR(kva) | PTE_VALID | (oldpte & PTE_WRITE);
+        frame_touch(KVADDR_TO_PADDR(kva), new, va);
+        return 0;
+}
 
-        return EFAULT;
+/*
+ * Share every resident page of OLD with NEW, copy-on-write: both
+ * mappings become read-only and the frame gets another reference.
+ * The first write through either mapping makes a private copy (see
+ * vm_cowpage). Because OLD loses write permission, the caller must
+ * flush any translations for OLD cached in the TLB. Pages of OLD that
+ * are paged out are copied. Pages of shared file mappings stay
+ * shared, with their access unchanged.
+ *
+ * Call with both as_locks held. Allocating memory here may page out
+ * more of OLD, so entries must be re-read after each allocation.
+ */
+int
+pt_copy(struct addrspace *old, struct addrspace *new)
+{
+        struct region *rg;
+        unsigned i, j;
+        paddr_t *l2, *pte;
+        vaddr_t va;
+        int result;
+
+        for (i=0; i<PT_NENTRIES; i++) {
+                l2 = old->as_pt[i];
+                if (l2 == NULL) {
+                        continue;
+                }
+                for (j=0; j<PT_NENTRIES; j++) {
+                        if (!(l2[j] & (PTE_VALID | PTE_SWAPPED))) {
+                                continue;
+                        }
+                        va = PT_VADDR(i, j);
+                        pte = pt_lookup(new, va, true);
+                        if (pte == NULL) {
+                                return ENOMEM;
+                        }
+                        if (!(l2[j] & (PTE_VALID | PTE_SWAPPED))) {
+                                /* A clean page, dropped meanwhile. */
+                                continue;
+                        }
+                        if (l2[j] & PTE_VALID) {
+                                frame_incref(l2[j] & PTE_FRAME);
+                                rg = as_findregion(old, va);
+                                KASSERT(rg != NULL);
+                                if (!(rg->rg_flags & RG_SHARED)) {
+                                        l2[j] &= ~PTE_WRITE;
+                                }
+                                *pte = l2[j];
+                        }
+                        else {
+                                result = pt_copyswapped(new, va, l2[j], pte);
+                                if (result) {
+                                        return result;
+                                }
+                        }
+                }
+        }
+        return 0;
+}
+
+/*
+ * Remove the NPAGES pages starting at VA from AS, freeing their
+ * frames and swap slots. The frames are only freed once no TLB can
+ * still reach them, so this goes in batches of TLBSHOOTDOWN_MAX
+ * pages: clear the entries, shoot them down, free the frames.
+ *
+ * Call with as_lock held (and no spinlocks).
+ */
+void
+pt_unmap(struct addrspace *as, vaddr_t va, size_t npages)
+{
+        struct tlbshootdown ts;
+        paddr_t frames[TLBSHOOTDOWN_MAX];
+        paddr_t *pte;
+        unsigned i, n;
+
+        KASSERT(lock_do_i_hold(as->as_lock));
+
+        while (npages > 0) {
+                vm_shootdown_init(&ts, as);
+                n = 0;
+                for (; npages > 0 && n < TLBSHOOTDOWN_MAX; npages--) {
+                        pte = pt_lookup(as, va, false);
+                        if (pte != NULL && (*pte & PTE_VALID)) {
+                                frames[n++] = *pte & PTE_FRAME;
+                                vm_shootdown_add(&ts, va);
+                        }
+                        else if (pte != NULL && (*pte & PTE_SWAPPED)) {
+                                swap_free(PTE_SLOT(*pte));
+                        }
+                        if (pte != NULL) {
+                                *pte = 0;
+                        }
+                        va += PAGE_SIZE;
+                }
+                vm_shootdown_send(&ts);
+                for (i=0; i<n; i++) {
+                        free_kpages(PADDR_TO_KVADDR(frames[i]));
+                }
+        }
 }
 
 /*
+ * TLB handling.
+ *
+ * TLB entries are tagged with an address space ID (the PID field of
+ * EntryHi), and the TLB only matches entries tagged with the ASID
+ * currently in c0_entryhi. Switching address spaces is then just a
+ * matter of changing that, with no flush.
+ *
+ * ASIDs are handed out per CPU, from tlb_asidnext[], whose upper bits
+ * count generations. An address space remembers in as_asid[] the
+ * ASID (with generation) it last got on each CPU; it is only good
+ * while its generation is the CPU's current one. When the 64 ASIDs
+ * run out, the TLB is flushed and a new generation starts, which
+ * invalidates every ASID handed out before. A generation count that
+ * wraps 32 bits skips generation 0, so that as_asid[] of 0 always
+ * means "none".
  *
- * SMP-specific functions.  Unused in our configuration.
+ * tlb_owner[] and tlb_asid[] record the address space (for comparison
+ * only; it may since have been destroyed) and ASID each CPU currently
+ * has loaded. All changes to the TLB end by putting tlb_asid[] back
+ * into c0_entryhi, since tlb_probe and tlb_write overwrite it.
+ *
+ * Each address space also has a bitmask, as_cpus, of the CPUs it has
+ * ever been activated on; bits are only ever set, under tlb_cpulock.
+ * Because entries outlive context switches, any of those CPUs may
+ * hold translations for it.
+ *
+ * Changing or removing a mapping that may be cached takes a TLB
+ * shootdown (vm_shootdown_*): the pages are invalidated here and an
+ * IPI carrying them goes to each other CPU in as_cpus, and we wait
+ * until they are all done. A CPU where the address space has no
+ * current ASID has nothing to do.
+ */
+
+#define ASID_MASK       (TLBHI_PID >> TLBHI_PIDSHIFT)
+#define ASID_FIRSTGEN   (ASID_MASK + 1)
+
+static uint32_t tlb_asidnext[MAXCPUS];
+static struct addrspace *tlb_owner[MAXCPUS];
+static uint32_t tlb_asid[MAXCPUS];
+static struct spinlock tlb_cpulock = SPINLOCK_INITIALIZER;
+
+/*
+ * Whether ASID (with generation) is still good on CPU C.
+ */
+static
+bool
+vm_asidvalid(uint32_t asid, unsigned c)
+{
+        return asid != 0 && ((asid ^ tlb_asidnext[c]) & ~ASID_MASK) == 0;
+}
+
+/*
+ * Hand out a new ASID on CPU C (the current CPU), starting a new
+ * generation if they have run out. Call with interrupts off.
+ */
+static
+uint32_t
+vm_asidalloc(unsigned c)
+{
+        uint32_t asid;
+
+        asid = ++tlb_asidnext[c];
+        if ((asid & ASID_MASK) == 0) {
+                /* New generation: every old ASID is now stale. */
+                if (asid == 0) {
+                        asid = ASID_FIRSTGEN;
+                        tlb_asidnext[c] = asid;
+                }
+                vm_tlbflush();
+        }
+        return asid;
+}
+
+/*
+ * Make ASID the one the TLB translates for on CPU C.
  */
+static
+void
+vm_asidload(uint32_t asid, unsigned c)
+{
+        tlb_asid[c] = asid & ASID_MASK;
+        tlb_setasid(tlb_asid[c]);
+}
 
 void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+vm_tlbflush(void)
+{
+        int i, spl;
+
+        /* Disable interrupts on this CPU while frobbing the TLB. */
+        spl = splhigh();
+        for (i=0; i<NUM_TLB; i++) {
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        }
+        tlb_setasid(tlb_asid[curcpu->c_number]);
+        splx(spl);
+}
+
+void
+vm_tlbinvalidate(struct addrspace *as, vaddr_t va)
 {
-        (void)ts;
-        panic("vm tried to do tlb shootdown?!\n");
+        unsigned c;
+        uint32_t asid;
+        int index, spl;
+
+        spl = splhigh();
+        c = curcpu->c_number;
+        asid = as->as_asid[c];
+        if (vm_asidvalid(asid, c)) {
+                index = tlb_probe((va & TLBHI_VPAGE) |
+                                  ((asid & ASID_MASK) << TLBHI_PIDSHIFT), 0);
+                if (index >= 0) {
+                        tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(),
+                                  index);
+                }
+                tlb_setasid(tlb_asid[c]);
+        }
+        splx(spl);
+}
+
+/*
+ * Make AS the address space the TLB translates for on this CPU,
+ * giving it a new ASID here if its old one has gone stale. Switching
+ * back to the address space that's already loaded costs nothing.
+ */
+void
+vm_tlbactivate(struct addrspace *as)
+{
+        unsigned c;
+        uint32_t bit;
+        int spl;
+
+        COMPILE_ASSERT(MAXCPUS <= 32);
+
+        spl = splhigh();
+        c = curcpu->c_number;
+        bit = (uint32_t)1 << c;
+        if ((as->as_cpus & bit) == 0) {
+                spinlock_acquire(&tlb_cpulock);
+                as->as_cpus |= bit;
+                spinlock_release(&tlb_cpulock);
+        }
+        if (tlb_owner[c] != as || !vm_asidvalid(as->as_asid[c], c)) {
+                if (!vm_asidvalid(as->as_asid[c], c)) {
+                        as->as_asid[c] = vm_asidalloc(c);
+                }
+                tlb_owner[c] = as;
+                vm_asidload(as->as_asid[c], c);
+        }
+        splx(spl);
 }
 
+/*
+ * Forget the address space loaded on this CPU, which is about to be
+ * destroyed. Its entries stay in the TLB, but its ASID is never
+ * loaded again before the next generation flushes them.
+ */
+void
+vm_tlbdeactivate(void)
+{
+        int spl;
+
+        spl = splhigh();
+        tlb_owner[curcpu->c_number] = NULL;
+        splx(spl);
+}
+
+/*
+ * Start a shootdown batch for AS.
+ */
+void
+vm_shootdown_init(struct tlbshootdown *ts, struct addrspace *as)
+{
+        ts->ts_as = as;
+        ts->ts_all = false;
+        ts->ts_npages = 0;
+}
+
+/*
+ * Add the page at VA to the batch. Past TLBSHOOTDOWN_MAX pages the
+ * batch becomes a flush of the whole address space.
+ */
+void
+vm_shootdown_add(struct tlbshootdown *ts, vaddr_t va)
+{
+        if (ts->ts_all) {
+                return;
+        }
+        if (ts->ts_npages == TLBSHOOTDOWN_MAX) {
+                ts->ts_all = true;
+                return;
+        }
+        ts->ts_vaddrs[ts->ts_npages++] = va & PAGE_FRAME;
+}
+
+/*
+ * Invalidate the batch on every CPU that may have it cached, and
+ * wait until that's done. The page table must already have been
+ * changed, so that nobody can load the old translations again.
+ *
+ * Spins with interrupts off; must not be called with a spinlock held,
+ * or a CPU spinning on it couldn't take the IPI.
+ */
+void
+vm_shootdown_send(struct tlbshootdown *ts)
+{
+        uint32_t cpus;
+        int spl;
+
+        if (!ts->ts_all && ts->ts_npages == 0) {
+                return;
+        }
+        KASSERT(curcpu->c_spinlocks == 0);
+
+        spl = splhigh();
+        vm_tlbshootdown(ts);
+        cpus = ts->ts_as->as_cpus & ~((uint32_t)1 << curcpu->c_number);
+        if (cpus != 0) {
+                ipi_tlbshootdown_cpus(cpus, ts);
+        }
+        splx(spl);
+}
+
+/*
+ * Load the translation for VA in the current address space into the
+ * TLB, tagged with its ASID. If an entry for VA may
+ * already be present (a write to a read-only mapping that we've
+ * since made writeable) it must be replaced in place, since the TLB
+ * must never hold two entries for the same page.
+ *
+ * Call with interrupts off.
+ */
+static
+void
+vm_tlbload(vaddr_t va, paddr_t pte, bool replace)
+{
+        uint32_t ehi, elo;
+        int index;
+
+        ehi = (va & TLBHI_VPAGE) |
+                (tlb_asid[curcpu->c_number] << TLBHI_PIDSHIFT);
+        elo = pte & (PTE_FRAME | PTE_WRITE | PTE_VALID);
+
+        if (replace) {
+                index = tlb_probe(ehi, 0);
+                if (index >= 0) {
+                        tlb_write(ehi, elo, index);
+                        return;
+                }
+        }
+        tlb_random(ehi, elo);
+}
+
+void
+vm_bootstrap(void)
+{
+        unsigned i;
+
+        for (i=0; i<MAXCPUS; i++) {
+                tlb_asidnext[i] = ASID_FIRSTGEN;
+        }
+        frametable_bootstrap();
+        swap_bootstrap();
+}
+
+/*
+ * Read the part of the page at VA that comes from RG's file into the
+ * frame at KVA. The rest of the frame must already be zeroed.
+ */
+static
+int
+vm_readpage(struct region *rg, vaddr_t va, vaddr_t kva)
+{
+        struct iovec iov;
+        struct uio ku;
+        vaddr_t start, end;
+        size_t len;
+        int result;
+
+        start = va > rg->rg_filevaddr ? va : rg->rg_filevaddr;
+        end = rg->rg_filevaddr + rg->rg_filesize;
+        if (end > va + PAGE_SIZE) {
+                end = va + PAGE_SIZE;
+        }
+        if (start >= end) {
+                /* All BSS. */
+                return 0;
+        }
+        len = end - start;
+
+        uio_kinit(&iov, &ku, (void *)(kva + (start - va)), len,
+                  rg->rg_offset + (start - rg->rg_filevaddr), UIO_READ);
+        result = VOP_READ(rg->rg_vnode, &ku);
+        if (result) {
+                return result;
+        }
+        if (ku.uio_resid != 0 && !(rg->rg_flags & RG_SHARED)) {
+                kprintf("vm: short read paging in 0x%x - "
+                        "file truncated?\n", va);
+                return EIO;
+        }
+        /* A mapping may run past the end of the file: that's zeros. */
+        return 0;
+}
+
+/*
+ * Write the page at KVA to the file VN at POS. The file is never
+ * extended: only the part of the page that lies before its current
+ * end is written.
+ */
+int
+vm_writefile(struct vnode *vn, off_t pos, vaddr_t kva)
+{
+        struct iovec iov;
+        struct uio ku;
+        struct stat st;
+        size_t len;
+        int result;
+
+        result = VOP_STAT(vn, &st);
+        if (result) {
+                return result;
+        }
+        if (pos >= st.st_size) {
+                return 0;
+        }
+        len = PAGE_SIZE;
+        if (st.st_size - pos < PAGE_SIZE) {
+                len = st.st_size - pos;
+        }
+
+        uio_kinit(&iov, &ku, (void *)kva, len, pos, UIO_WRITE);
+        result = VOP_WRITE(vn, &ku);
+        if (result) {
+                return result;
+        }
+        if (ku.uio_resid != 0) {
+                return EIO;
+        }
+        return 0;
+}
+
+/*
+ * Write the page at VA of the shared file mapping RG, in the frame at
+ * KVA, back to the file.
+ */
+static
+int
+vm_writepage(struct region *rg, vaddr_t va, vaddr_t kva)
+{
+        KASSERT(rg->rg_flags & RG_SHARED);
+
+        return vm_writefile(rg->rg_vnode,
+                            rg->rg_offset + (va - rg->rg_filevaddr), kva);
+}
+
+/*
+ * Write every modified page of the shared file mapping RG in AS back
+ * to the file. Each page is write-protected (and shot down) before it
+ * is written, so a store that races with the write faults and marks
+ * it modified again. Returns the first error, but tries every page.
+ * Call with as_lock held.
+ */
+int
+vm_syncregion(struct addrspace *as, struct region *rg)
+{
+        struct tlbshootdown ts;
+        paddr_t *pte;
+        vaddr_t va;
+        size_t i;
+        int result, err;
+
+        KASSERT(lock_do_i_hold(as->as_lock));
+        KASSERT(rg->rg_flags & RG_SHARED);
+
+        err = 0;
+        for (i=0; i<rg->rg_npages; i++) {
+                va = rg->rg_vbase + i * PAGE_SIZE;
+                pte = pt_lookup(as, va, false);
+                if (pte == NULL || (*pte & (PTE_VALID | PTE_MODIFIED)) !=
+                    (PTE_VALID | PTE_MODIFIED)) {
+                        continue;
+                }
+                *pte &= ~(PTE_WRITE | PTE_MODIFIED);
+                vm_shootdown_init(&ts, as);
+                vm_shootdown_add(&ts, va);
+                vm_shootdown_send(&ts);
+
+                result = vm_writepage(rg, va, PADDR_TO_KVADDR(*pte & PTE_FRAME));
+                if (result) {
+                        /* Leave it marked so a later sync tries again. */
+                        *pte |= PTE_MODIFIED;
+                        if (err == 0) {
+                                err = result;
+                        }
+                }
+        }
+        return err;
+}
+
+/*
+ * Give the page at VA in region RG a frame: zero-filled, with any
+ * part of it that is backed by a file read in. Call with as_lock
+ * held.
+ */
+static
+int
+vm_newpage(struct region *rg, vaddr_t va, paddr_t *pte)
+{
+        vaddr_t kva;
+        int result;
+
+        kva = alloc_kpages(1);
+        if (kva == 0) {
+                return ENOMEM;
+        }
+        bzero((void *)kva, PAGE_SIZE);
+
+        if (rg->rg_vnode != NULL) {
+                result = vm_readpage(rg, va, kva);
+                if (result) {
+                        free_kpages(kva);
+                        return result;
+                }
+        }
+
+        *pte = KVADDR_TO_PADDR(kva) | PTE_VALID;
+        if ((rg->rg_flags & (RG_WRITE | RG_SHARED)) == RG_WRITE) {
+                *pte |= PTE_WRITE;
+        }
+        DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", va, *pte & PTE_FRAME);
+        return 0;
+}
+
+/*
+ * Handle a write to a copy-on-write page at VA in AS. If nobody else
+ * refers to the frame any more, just take it over; otherwise make a
+ * private copy and drop our reference to the shared one, after
+ * shooting down the old translation wherever AS may have it cached.
+ * Call with as_lock held.
+ */
+static
+int
+vm_cowpage(struct addrspace *as, vaddr_t va, paddr_t *pte)
+{
+        struct tlbshootdown ts;
+        paddr_t pa;
+        vaddr_t kva;
+
+        pa = *pte & PTE_FRAME;
+        if (frame_refcount(pa) == 1) {
+                *pte |= PTE_WRITE;
+                return 0;
+        }
+
+        kva = alloc_kpages(1);
+        if (kva == 0) {
+                return ENOMEM;
+        }
+        memmove((void *)kva, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+        *pte = KVADDR_TO_PADDR(kva) | PTE_VALID | PTE_WRITE;
+        vm_shootdown_init(&ts, as);
+        vm_shootdown_add(&ts, va);
+        vm_shootdown_send(&ts);
+        free_kpages(PADDR_TO_KVADDR(pa));
+        return 0;
+}
+
+/*
+ * Bring the paged-out page PTE back in from swap. Call with as_lock
+ * held.
+ */
+static
+int
+vm_swapin(paddr_t *pte)
+{
+        vaddr_t kva;
+        int result;
+
+        kva = alloc_kpages(1);
+        if (kva == 0) {
+                return ENOMEM;
+        }
+        result = swap_in(PTE_SLOT(*pte), kva);
+        if (result) {
+                free_kpages(kva);
+                return result;
+        }
+        swap_free(PTE_SLOT(*pte));
+        *pte = KVADDR_TO_PADDR(kva) | PTE_VALID | (*pte & PTE_WRITE);
+        return 0;
+}
+
+int
+vm_pageout(struct addrspace *as, vaddr_t va, paddr_t pa)
+{
+        struct tlbshootdown ts;
+        struct region *rg;
+        paddr_t *pte;
+        paddr_t entry;
+        unsigned slot;
+        int result;
+
+        KASSERT(lock_do_i_hold(as->as_lock));
+
+        pte = pt_lookup(as, va, false);
+        KASSERT(pte != NULL);
+        KASSERT((*pte & (PTE_FRAME | PTE_VALID)) == (pa | PTE_VALID));
+
+        rg = as_findregion(as, va);
+        KASSERT(rg != NULL);
+        if ((rg->rg_flags & RG_SHARED) && (*pte & PTE_MODIFIED)) {
+                /*
+                 * Writing it to the file would take vfs_biglock,
+                 * which the caller, or the owner while it waits
+                 * for as_lock, may hold. The cleaner does it.
+                 */
+                return EBUSY;
+        }
+
+        /*
+         * Unmap it first, so the owner can't change the page while
+         * it's being written out; its next access will fault and
+         * wait for as_lock.
+         */
+        entry = *pte;
+        *pte = 0;
+        vm_shootdown_init(&ts, as);
+        vm_shootdown_add(&ts, va);
+        vm_shootdown_send(&ts);
+
+        if (rg->rg_flags & RG_SHARED) {
+                /* Clean, so already the same as the file. */
+                return 0;
+        }
+        if (rg->rg_vnode != NULL && !(rg->rg_flags & RG_WRITE)) {
+                /* Never written; vm_fault will read it back from the file. */
+                return 0;
+        }
+
+        result = swap_out(PADDR_TO_KVADDR(pa), &slot);
+        if (result) {
+                *pte = entry;
+                return result;
+        }
+        *pte = PTE_MKSWAPPED(slot) | (entry & PTE_WRITE);
+        DEBUG(DB_VM, "vm: paged out 0x%x to slot %u\n", va, slot);
+        return 0;
+}
+
+int
+vm_cleanprep(struct addrspace *as, vaddr_t va, paddr_t pa,
+             struct vnode **vn, off_t *pos)
+{
+        struct tlbshootdown ts;
+        struct region *rg;
+        paddr_t *pte;
+
+        KASSERT(lock_do_i_hold(as->as_lock));
+
+        pte = pt_lookup(as, va, false);
+        if (pte == NULL || (*pte & (PTE_FRAME | PTE_VALID | PTE_MODIFIED)) !=
+            (pa | PTE_VALID | PTE_MODIFIED)) {
+                return EINVAL;
+        }
+        rg = as_findregion(as, va);
+        KASSERT(rg != NULL && (rg->rg_flags & RG_SHARED));
+
+        /* As in vm_syncregion: a store from now on marks it again. */
+        *pte &= ~(PTE_WRITE | PTE_MODIFIED);
+        vm_shootdown_init(&ts, as);
+        vm_shootdown_add(&ts, va);
+        vm_shootdown_send(&ts);
+
+        VOP_INCREF(rg->rg_vnode);
+        *vn = rg->rg_vnode;
+        *pos = rg->rg_offset + (va - rg->rg_filevaddr);
+        return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+        struct addrspace *as;
+        struct region *rg;
+        paddr_t *pte;
+        paddr_t entry;
+        bool write;
+        int result, spl;
+
+        faultaddress &= PAGE_FRAME;
+
+        switch (faulttype) {
+            case VM_FAULT_READONLY:
+            case VM_FAULT_WRITE:
+                write = true;
+                break;
+            case VM_FAULT_READ:
+                write = false;
+                break;
+            default:
+                return EINVAL;
+        }
+
+        if (curproc == NULL) {
+                /*
+                 * No process. This is probably a kernel fault early
+                 * in boot. Return EFAULT so as to panic instead of
+                 * getting into an infinite faulting loop.
+                 */
+                return EFAULT;
+        }
+
+        as = proc_getas();
+        if (as == NULL) {
+                /*
+                 * No address space set up. This is probably also a
+                 * kernel fault early in boot.
+                 */
+                return EFAULT;
+        }
+
+        if (faultaddress >= USERSPACETOP) {
+                return EFAULT;
+        }
+
+        /*
+         * Fast path: the page is resident with the access we need,
+         * so this was only a TLB miss. Walk the table and refill
+         * without taking as_lock. Page-out unmaps a page before it
+         * touches the frame, and then waits for a TLB shootdown,
+         * which this CPU won't take while interrupts are off.
+         */
+        if (faulttype != VM_FAULT_READONLY) {
+                spl = splhigh();
+                pte = pt_lookup(as, faultaddress, false);
+                if (pte != NULL && (*pte & PTE_VALID) &&
+                    (!write || (*pte & PTE_WRITE))) {
+                        entry = *pte;
+                        vm_tlbload(faultaddress, entry, false);
+                        frame_touch(entry & PTE_FRAME, as, faultaddress);
+                        splx(spl);
+                        return 0;
+                }
+                splx(spl);
+        }
+
+        /*
+         * Slow path: first touch of the page, a page that was paged
+         * out, or a write to a page that is shared copy-on-write. The
+         * page must lie within a defined region, and writes only
+         * within a writeable one.
+         */
+        lock_acquire(as->as_lock);
+
+        rg = as_findregion(as, faultaddress);
+        if (rg == NULL || (write && !(rg->rg_flags & RG_WRITE))) {
+                lock_release(as->as_lock);
+                return EFAULT;
+        }
+
+        pte = pt_lookup(as, faultaddress, true);
+        if (pte == NULL) {
+                lock_release(as->as_lock);
+                return ENOMEM;
+        }
+        result = 0;
+        if (*pte & PTE_SWAPPED) {
+                result = vm_swapin(pte);
+        }
+        else if (!(*pte & PTE_VALID)) {
+                result = vm_newpage(rg, faultaddress, pte);
+        }
+        if (result == 0 && write && !(*pte & PTE_WRITE)) {
+                if (rg->rg_flags & RG_SHARED) {
+                        /* First write to a page of a file mapping. */
+                        *pte |= PTE_WRITE | PTE_MODIFIED;
+                }
+                else {
+                        result = vm_cowpage(as, faultaddress, pte);
+                }
+        }
+        if (result) {
+                lock_release(as->as_lock);
+                return result;
+        }
+        entry = *pte;
+
+        /*
+         * Load the TLB before letting go of as_lock, so the page
+         * can't be paged out in between.
+         */
+        spl = splhigh();
+        vm_tlbload(faultaddress, entry, faulttype == VM_FAULT_READONLY);
+        frame_touch(entry & PTE_FRAME, as, faultaddress);
+        splx(spl);
+
+        lock_release(as->as_lock);
+
+        return 0;
+}
+
+/*
+ * Carry out one shootdown request on this CPU, from
+ * vm_shootdown_send or interprocessor_interrupt. NULL means the IPI
+ * queue overflowed: flush everything.
+ *
+ * To drop all of an address space's translations we just take its
+ * ASID away; if it is the one loaded here, it gets a new one now.
+ */
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+        struct addrspace *as;
+        unsigned c, i;
+        int spl;
+
+        spl = splhigh();
+        c = curcpu->c_number;
+        if (ts == NULL) {
+                vm_tlbflush();
+        }
+        else if (vm_asidvalid(ts->ts_as->as_asid[c], c)) {
+                as = ts->ts_as;
+                if (ts->ts_all) {
+                        as->as_asid[c] = 0;
+                        if (tlb_owner[c] == as) {
+                                as->as_asid[c] = vm_asidalloc(c);
+                                vm_asidload(as->as_asid[c], c);
+                        }
+                }
+                else {
+                        for (i=0; i<ts->ts_npages; i++) {
+                                vm_tlbinvalidate(as, ts->ts_vaddrs[i]);
+                        }
+                }
+        }
+        splx(spl);
+}
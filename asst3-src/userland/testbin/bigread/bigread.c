@@ -0,0 +1,147 @@
+/*
+ * bigread - large file read benchmark.
+ *
+ * Usage: bigread <name> [<nfiles>]
+ *
+ * Writes NFILES files (default 32) of FILESIZE bytes each, named
+ * <name>0, <name>1, and so on, then reads them all through from start
+ * to end, then reads the same number of chunks at random places, and
+ * prints how long each took. The sequential read should benefit from
+ * the file system's read-ahead; the random one shouldn't.
+ *
+ * SFS files can't be much bigger than 70K, which is why there are
+ * several of them. Together they should be bigger than the kernel's
+ * buffer cache, or the reads will mostly be cache hits.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define CHUNK		4096
+#define FILESIZE	(64*1024)
+#define PERFILE		(FILESIZE / CHUNK)
+#define MAXFILES	256
+
+static char buf[CHUNK];
+static int fds[MAXFILES];
+
+/*
+ * Microseconds since START.
+ */
+static
+unsigned long
+elapsed(time_t startsecs, unsigned long startnsecs)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (secs - startsecs) * 1000000 + nsecs / 1000 - startnsecs / 1000;
+}
+
+static
+void
+report(const char *what, unsigned nchunks, unsigned long us)
+{
+	unsigned long kb = nchunks * (CHUNK / 1024);
+
+	printf("%s: %lu KB in %lu ms (%lu KB/s)\n", what, kb, us / 1000,
+	       us ? (unsigned long)((unsigned long long)kb * 1000000 / us) :
+	       0);
+}
+
+/*
+ * Read chunk N of file F and check it's what was written.
+ */
+static
+void
+readchunk(unsigned f, unsigned n)
+{
+	ssize_t len;
+
+	len = read(fds[f], buf, sizeof(buf));
+	if (len < 0) {
+		err(1, "file %u: read", f);
+	}
+	if (len != CHUNK || buf[0] != (char)('a' + (f + n) % 26)) {
+		errx(1, "file %u: chunk %u read back wrong", f, n);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	char name[64];
+	unsigned nfiles, f, n, i;
+	time_t secs;
+	unsigned long nsecs;
+	ssize_t len;
+	int fd;
+
+	if (argc != 2 && argc != 3) {
+		errx(1, "Usage: bigread <name> [<nfiles>]");
+	}
+	nfiles = argc == 3 ? atoi(argv[2]) : 32;
+	if (nfiles == 0 || nfiles > MAXFILES) {
+		errx(1, "Between 1 and %d files, please", MAXFILES);
+	}
+
+	printf("Writing %u files of %d KB...\n", nfiles, FILESIZE / 1024);
+	for (f=0; f<nfiles; f++) {
+		snprintf(name, sizeof(name), "%s%u", argv[1], f);
+		fd = open(name, O_WRONLY|O_CREAT|O_TRUNC);
+		if (fd < 0) {
+			err(1, "%s: create", name);
+		}
+		for (n=0; n<PERFILE; n++) {
+			memset(buf, 'a' + (f + n) % 26, sizeof(buf));
+			len = write(fd, buf, sizeof(buf));
+			if (len < 0) {
+				err(1, "%s: write", name);
+			}
+			if (len != CHUNK) {
+				errx(1, "%s: short write", name);
+			}
+		}
+		close(fd);
+	}
+
+	for (f=0; f<nfiles; f++) {
+		snprintf(name, sizeof(name), "%s%u", argv[1], f);
+		fds[f] = open(name, O_RDONLY);
+		if (fds[f] < 0) {
+			err(1, "%s: open", name);
+		}
+	}
+
+	__time(&secs, &nsecs);
+	for (f=0; f<nfiles; f++) {
+		for (n=0; n<PERFILE; n++) {
+			readchunk(f, n);
+		}
+	}
+	report("Sequential", nfiles * PERFILE, elapsed(secs, nsecs));
+
+	srandom(nfiles);
+	__time(&secs, &nsecs);
+	for (i=0; i<nfiles * PERFILE; i++) {
+		f = random() % nfiles;
+		n = random() % PERFILE;
+		if (lseek(fds[f], (off_t)n * CHUNK, SEEK_SET) < 0) {
+			err(1, "file %u: lseek", f);
+		}
+		readchunk(f, n);
+	}
+	report("Random", nfiles * PERFILE, elapsed(secs, nsecs));
+
+	for (f=0; f<nfiles; f++) {
+		close(fds[f]);
+		snprintf(name, sizeof(name), "%s%u", argv[1], f);
+		remove(name);
+	}
+	return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * catconc - concurrent reader benchmark.
+ *
+ * Usage: catconc [-w] filesystem [<nprocs>]
+ *
+ * The reading counterpart of dirconc. With -w, writes NPROCS files
+ * (default 8) on FILESYSTEM, each followed on the disk by a gap of
+ * scratch files, then writes FLUSHFILES more to push everything out
+ * of the buffer cache, and removes all the scratch files. Without,
+ * runs NPROCS copies of /bin/cat at once, one on each of the files,
+ * with their output going to null:, prints how long they took, and
+ * removes the files.
+ *
+ * In arrival order the disk head goes back and forth between the
+ * files; an elevator should do better. The seek distance is counted
+ * in the kernel, so compare schedulers from the kernel menu:
+ *
+ *     p /testbin/catconc -w lhd1:
+ *     ios fifo; ios -c; p /testbin/catconc lhd1: ; ios
+ *     p /testbin/catconc -w lhd1:
+ *     ios clook; ios -c; p /testbin/catconc lhd1: ; ios
+ *
+ * SFS reads one block at a time under its big lock, so the cats
+ * themselves keep at most one request in the disk queue; the rest
+ * come from the kernel's read-ahead threads, which read runs of
+ * blocks in parallel. So the queue is only a handful deep, and the
+ * difference between schedulers is smaller than NPROCS would suggest.
+ *
+ * The disk needs room for FILESIZE times NPROCS * (GAPFILES + 1) +
+ * FLUSHFILES bytes, 5M by default.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define FILESIZE	(64*1024)	/* about as big as SFS allows */
+#define GAPFILES	4		/* scratch files after each file */
+
+/*
+ * Enough to fill the biggest buffer cache the kernel makes, with room
+ * to spare. Keep CACHEMAX in step with BUF_MAXBUFS * BUF_SIZE in
+ * kern/vfs/buf.c.
+ */
+#define CACHEMAX	(4096*512)
+#define FLUSHFILES	(CACHEMAX / FILESIZE + 8)
+#define MAXPROCS	32
+
+static char buf[4096];
+
+/*
+ * Write a file of FILESIZE bytes of C.
+ */
+static
+void
+writefile(const char *name, char c)
+{
+	unsigned i;
+	ssize_t len;
+	int fd;
+
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC);
+	if (fd < 0) {
+		err(1, "%s: create", name);
+	}
+	memset(buf, c, sizeof(buf));
+	for (i=0; i<FILESIZE/sizeof(buf); i++) {
+		len = write(fd, buf, sizeof(buf));
+		if (len < 0) {
+			err(1, "%s: write", name);
+		}
+		if (len != sizeof(buf)) {
+			errx(1, "%s: short write", name);
+		}
+	}
+	close(fd);
+}
+
+static
+void
+setup(unsigned nprocs)
+{
+	char name[32];
+	unsigned i, j;
+
+	for (i=0; i<nprocs; i++) {
+		snprintf(name, sizeof(name), "catconc.%u", i);
+		writefile(name, 'a' + i % 26);
+		for (j=0; j<GAPFILES; j++) {
+			snprintf(name, sizeof(name), "catconc.gap%u.%u", i, j);
+			writefile(name, '-');
+		}
+	}
+	for (i=0; i<FLUSHFILES; i++) {
+		snprintf(name, sizeof(name), "catconc.flush%u", i);
+		writefile(name, '-');
+	}
+
+	for (i=0; i<nprocs; i++) {
+		for (j=0; j<GAPFILES; j++) {
+			snprintf(name, sizeof(name), "catconc.gap%u.%u", i, j);
+			remove(name);
+		}
+	}
+	for (i=0; i<FLUSHFILES; i++) {
+		snprintf(name, sizeof(name), "catconc.flush%u", i);
+		remove(name);
+	}
+	sync();
+}
+
+static
+pid_t
+spawncat(unsigned i)
+{
+	char name[32];
+	char *args[3];
+	pid_t pid;
+	int fd;
+
+	snprintf(name, sizeof(name), "catconc.%u", i);
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		/* child */
+		fd = open("null:", O_WRONLY);
+		if (fd < 0) {
+			err(1, "null:");
+		}
+		if (dup2(fd, STDOUT_FILENO) < 0) {
+			err(1, "dup2");
+		}
+		close(fd);
+		args[0] = (char *)"cat";
+		args[1] = name;
+		args[2] = NULL;
+		execv("/bin/cat", args);
+		err(1, "/bin/cat");
+	}
+	return pid;
+}
+
+int
+main(int argc, char *argv[])
+{
+	pid_t pids[MAXPROCS];
+	char name[32];
+	unsigned nprocs, i;
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs, ms;
+	int status, failed = 0;
+	int dowrite = 0;
+
+	if (argc > 1 && !strcmp(argv[1], "-w")) {
+		dowrite = 1;
+		argc--;
+		argv++;
+	}
+	if (argc != 2 && argc != 3) {
+		errx(1, "Usage: catconc [-w] filesystem [<nprocs>]");
+	}
+	nprocs = argc == 3 ? atoi(argv[2]) : 8;
+	if (nprocs == 0 || nprocs > MAXPROCS) {
+		errx(1, "Between 1 and %d processes, please", MAXPROCS);
+	}
+
+	if (chdir(argv[1]) < 0) {
+		err(1, "chdir: %s", argv[1]);
+	}
+
+	if (dowrite) {
+		printf("Writing %u files...\n", nprocs);
+		setup(nprocs);
+		return 0;
+	}
+
+	printf("Reading them with %u cats at once...\n", nprocs);
+	__time(&startsecs, &startnsecs);
+	for (i=0; i<nprocs; i++) {
+		pids[i] = spawncat(i);
+	}
+	for (i=0; i<nprocs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			warnx("cat of catconc.%u failed", i);
+			failed = 1;
+		}
+	}
+	__time(&endsecs, &endnsecs);
+
+	ms = (endsecs - startsecs) * 1000 + endnsecs / 1000000 -
+		startnsecs / 1000000;
+	printf("%u files, %u KB, in %lu ms\n", nprocs,
+	       nprocs * (FILESIZE / 1024), ms);
+
+	for (i=0; i<nprocs; i++) {
+		snprintf(name, sizeof(name), "catconc.%u", i);
+		remove(name);
+	}
+
+	return failed;
+}
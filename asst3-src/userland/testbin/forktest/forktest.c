@@ -34,6 +34,9 @@
  *
  * It should also continue to work after subsequent assignments, most
  * notably after implementing the virtual memory system.
+ *
+ * With -t, it instead times a loop of fork, child exit, and waitpid,
+ * and prints the average cost of the round trip.
  */
 
 #include <unistd.h>
@@ -42,6 +45,8 @@
 #include <stdio.h>
 #include <err.h>
 
+#define NTIMED	1000	/* round trips for -t */
+
 /*
  * This is used by all processes, to try to help make sure all
  * processes have a distinct address space.
@@ -193,6 +198,38 @@ test(int nowait)
 	putchar('\n');
 }
 
+/*
+ * Time NTIMED fork/exit/waitpid round trips.
+ */
+static
+void
+timefork(void)
+{
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long long ns;
+	int i, pid, x;
+
+	__time(&startsecs, &startnsecs);
+	for (i=0; i<NTIMED; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			_exit(0);
+		}
+		if (waitpid(pid, &x, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+	__time(&endsecs, &endnsecs);
+
+	ns = (endsecs - startsecs) * 1000000000ULL + endnsecs - startnsecs;
+	printf("%d forks: %llu us per fork+exit+waitpid\n",
+	       NTIMED, ns / NTIMED / 1000);
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -203,8 +240,12 @@ main(int argc, char *argv[])
 	if (argc==2 && !strcmp(argv[1], "-w")) {
 		nowait=1;
 	}
+	else if (argc==2 && !strcmp(argv[1], "-t")) {
+		timefork();
+		return 0;
+	}
 	else if (argc!=1 && argc!=0) {
-		warnx("usage: forktest [-w]");
+		warnx("usage: forktest [-w|-t]");
 		return 1;
 	}
 	warnx("Starting. Expect this many:");
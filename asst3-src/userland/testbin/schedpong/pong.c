@@ -33,6 +33,7 @@
  */
 
 #include <stdio.h>
+#include <unistd.h>
 #include <err.h>
 #include <assert.h>
 
@@ -46,6 +47,54 @@
 static struct usem sems[MAXCOUNT];
 static unsigned nsems;
 
+/*
+ * Wakeup latency. In the cyclic pongs, ponger 0 times each trip
+ * around the ring, from its V to its P returning. That is nsems
+ * handoffs, each of which is a process being woken and then having
+ * to get onto a CPU past the thinkers and grinders.
+ *
+ * The pongers are separate processes with no memory in common, so
+ * there's nowhere to pass the time of each V along to the next P;
+ * hence only whole trips are timed. The worst figure is therefore the
+ * slowest trip's average per handoff, not the slowest single handoff.
+ */
+static unsigned long long trip_start;
+static unsigned long long trip_total;
+static unsigned long long trip_worst;
+static unsigned trip_count;
+
+static
+unsigned long long
+now_ns(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000000000ULL + nsecs;
+}
+
+static
+void
+trip_begin(void)
+{
+	trip_start = now_ns();
+}
+
+static
+void
+trip_end(void)
+{
+	unsigned long long t;
+
+	t = now_ns() - trip_start;
+	trip_total += t;
+	if (t > trip_worst) {
+		trip_worst = t;
+	}
+	trip_count++;
+}
+
 /*
  * Set up the semaphores. This happens in the task director process,
  * so if we have multiple pong groups each has its own sems[] array.
@@ -98,6 +147,9 @@ pong_cyclic(unsigned id)
 	for (i=0; i<PONGLOOPS; i++) {
 		if (i > 0 || id > 0) {
 			P(&sems[id]);
+			if (id == 0) {
+				trip_end();
+			}
 		}
 #ifdef VERBOSE_PONG
 		printf(" %u", id);
@@ -106,10 +158,14 @@ pong_cyclic(unsigned id)
 			putchar('.');
 		}
 #endif
+		if (id == 0) {
+			trip_begin();
+		}
 		V(&sems[nextid]);
 	}
 	if (id == 0) {
 		P(&sems[id]);
+		trip_end();
 	}
 #ifdef VERBOSE_PONG
 	putchar('\n');
@@ -186,8 +242,6 @@ pong(unsigned groupid, unsigned id)
 {
 	unsigned idfwd, idback;
 
-	(void)groupid;
-
 	idfwd = (id + 1) % nsems;
 	idback = (id + nsems - 1) % nsems;
 	usem_open(&sems[id]);
@@ -205,6 +259,14 @@ pong(unsigned groupid, unsigned id)
 #endif
 	pong_cyclic(id);
 
+	if (id == 0 && trip_count > 0) {
+		printf("Pong group %u wakeup latency per handoff: %llu us "
+		       "average, %llu us in the worst trip "
+		       "(%u trips of %u handoffs)\n", groupid - 2,
+		       trip_total / trip_count / nsems / 1000,
+		       trip_worst / nsems / 1000, trip_count, nsems);
+	}
+
 	usem_close(&sems[id]);
 	usem_close(&sems[idfwd]);
 	usem_close(&sems[idback]);